@@ -1,28 +1,183 @@
 #include "httplib.h"
 #include "json.hpp"
 
+#include <algorithm>
+#include <cctype>
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <streambuf>
 #include <vector>
 #include <mutex>
 #include <unordered_map>
+#include <optional>
+
+#include <poll.h>
 
 using json = nlohmann::json;
 
+const std::string kUnixPrefix = "unix:";
+
+bool IsUnix(const std::string& address) {
+    return address.compare(0, kUnixPrefix.size(), kUnixPrefix) == 0;
+}
+
+bool IsJson(const std::string& content_type) {
+    std::string media = content_type.substr(0, content_type.find(';'));
+    media.erase(media.find_last_not_of(" \t") + 1);
+    return media.size() == 16 && std::equal(media.begin(), media.end(), "application/json", [](char a, char b) {
+        return std::tolower(static_cast<unsigned char>(a)) == b;
+    });
+}
+
+httplib::Client MakeClient(const std::string& address) {
+    if (!IsUnix(address)) {
+        return httplib::Client(address);
+    }
+
+    httplib::Client cli(address.substr(kUnixPrefix.size()), 80);
+    cli.set_address_family(AF_UNIX);
+    return cli;
+}
+
+// Several requests written back to back on one connection; connecting, writing and
+// reading the responses (chunked and gzip included) go through httplib.
+class Pipeline {
+public:
+
+    static constexpr size_t kMaxRequests = 64;
+
+    explicit Pipeline(const std::string& address)
+        : unix_(IsUnix(address)) {
+        httplib::Client cli = MakeClient(address);
+        host_ = cli.host();
+        port_ = cli.port();
+    }
+
+    ~Pipeline() {
+        if (sock_ != INVALID_SOCKET) {
+            httplib::detail::close_socket(sock_);
+        }
+    }
+
+    void Post(const std::string& path, const std::string& body) {
+        std::string host = unix_ ? "localhost" : host_ + ":" + std::to_string(port_);
+        out_ += "POST " + path + " HTTP/1.1\r\nHost: " + host + "\r\n"
+                "Content-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+        out_ += body;
+        ++count_;
+    }
+
+    size_t Size() const {
+        return count_;
+    }
+
+    // Writes every queued request at once and reads the responses back in order.
+    // Requests left without a response report status 0.
+    std::vector<int> Send() {
+        std::vector<int> statuses(count_, 0);
+        httplib::Error error = httplib::Error::Success;
+        sock_ = httplib::detail::create_client_socket(
+            host_, "", port_, unix_ ? AF_UNIX : AF_UNSPEC, true, false, nullptr,
+            kTimeoutSec, 0, kTimeoutSec, 0, kTimeoutSec, 0, "", error);
+        if (sock_ == INVALID_SOCKET) {
+            return statuses;
+        }
+
+        httplib::detail::SocketStream strm(sock_, kTimeoutSec, 0, kTimeoutSec, 0);
+        if (httplib::detail::write_data(strm, out_.data(), out_.size())) {
+            for (size_t i = 0; i < count_ && ReadResponse(strm, &statuses[i]); ++i) {
+            }
+        }
+        return statuses;
+    }
+
+private:
+
+    static bool ReadResponse(httplib::Stream& strm, int* status) {
+        char buffer[2048];
+        httplib::detail::stream_line_reader line(strm, buffer, sizeof(buffer));
+        std::string version;
+        int code = 0;
+        if (!line.getline() || !(std::istringstream(line.ptr()) >> version >> code)) {
+            return false;
+        }
+
+        httplib::Response res;
+        if (!httplib::detail::read_headers(strm, res.headers)) {
+            return false;
+        }
+
+        if (res.has_header("Content-Length") || httplib::detail::is_chunked_transfer_encoding(res.headers)) {
+            int error = 0;
+            auto discard = [](const char*, size_t, uint64_t, uint64_t) { return true; };
+            if (!httplib::detail::read_content(strm, res, CPPHTTPLIB_PAYLOAD_MAX_LENGTH, error, nullptr, discard, true)) {
+                return false;
+            }
+        }
+
+        *status = code;
+        return true;
+    }
+
+    static constexpr time_t kTimeoutSec = 5;
+
+    bool unix_;
+    std::string host_;
+    int port_ = 0;
+    socket_t sock_ = INVALID_SOCKET;
+    std::string out_;
+    size_t count_ = 0;
+};
+
+// Reads stdin with read(2) into its own buffer, so in_avail() sees input that has already
+// arrived and predicts queued there can be sent together.
+class InputBuffer : public std::streambuf {
+protected:
+
+    int_type underflow() override {
+        ssize_t ret;
+        do {
+            ret = ::read(STDIN_FILENO, buffer_, sizeof(buffer_));
+        } while (ret < 0 && errno == EINTR);
+
+        if (ret <= 0) {
+            return traits_type::eof();
+        }
+        setg(buffer_, buffer_, buffer_ + ret);
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    char buffer_[4096];
+};
+
+// Whether a command is already buffered from stdin; blanks in front of it are skipped.
+bool HasQueuedInput() {
+    std::streambuf* input = std::cin.rdbuf();
+    while (input->in_avail() > 0 && std::isspace(input->sgetc())) {
+        input->sbumpc();
+    }
+    return input->in_avail() > 0;
+}
+
 class User {
 public:
 
     void Run(int argc, char* argv[]) {
         for (;;) {
             std::string command;
-            std::cin >> command;
+            if (Next_.empty()) {
+                std::cin >> command;
+            } else {
+                command.swap(Next_);
+            }
 
             if (command == "register") {
-                httplib::Client cli(argv[2]);
+                httplib::Client cli = MakeClient(argv[2]);
 
                 json req;
-                req["host"] = "localhost:" + std::string(argv[1]);
+                req["host"] = IsUnix(argv[1]) ? std::string(argv[1]) : "localhost:" + std::string(argv[1]);
                 auto res = cli.Post("/user/register", req.dump(), "application/json");
                 if (res && res->status == 200) {
 
@@ -38,32 +193,57 @@ public:
             }
 
             if (command == "predict") {
-                int num;
-                std::cin >> num;
-
-                httplib::Client cli(argv[2]);
+                Pipeline pipeline(argv[2]);
+                for (;;) {
+                    int num;
+                    std::cin >> num;
+
+                    json req;
+                    req["id"] = Id_;
+                    req["pred"] = num;
+                    pipeline.Post("/user/predict", req.dump());
+
+                    if (pipeline.Size() == Pipeline::kMaxRequests || !HasQueuedInput() || !(std::cin >> command)) {
+                        break;
+                    }
+                    if (command != "predict") {
+                        Next_ = command;
+                        break;
+                    }
+                }
 
-                json req;
-                req["id"] = Id_;
-                req["pred"] = num;
-                auto res = cli.Post("/user/predict", req.dump(), "application/json");
-                if (res && res->status == 200) {
-                    std::cout << "Ok\n";
-                } else {
-                    std::cout << "Erorr\n";
+                for (int status : pipeline.Send()) {
+                    std::cout << (status == 200 ? "Ok\n" : "Erorr\n");
                 }
                 continue;
             }
 
             if (command == "see-my-predictions") {
-                httplib::Client cli(argv[2]);
+                httplib::Client cli = MakeClient(argv[2]);
 
                 json req;
                 req["id"] = Id_;
-                auto res = cli.Post("/user/predict", req.dump(), "application/json");
-                if (res && res->status == 200) {
+                req["experiment"] = Cache_.Experiment;
+                req["since"] = Cache_.Version;
+
+                httplib::Headers headers;
+                if (!Cache_.ETag.empty()) {
+                    headers.emplace("If-None-Match", Cache_.ETag);
+                }
+
+                auto res = cli.Post("/user/get", headers, req.dump(), "application/json");
+                if (res && res->status == 304) {
+                    std::cout << Cache_.Predictions << '\n';
+                } else if (res && res->status == 200) {
                     auto result = json::parse(res->body);
-                    std::cout << result["predictions"] << '\n';
+                    if (result["since"] != req["since"] || result["experiment"] != Cache_.Experiment) {
+                        Cache_.Predictions.clear();
+                    }
+                    Cache_.Experiment = result["experiment"];
+                    Cache_.Version = result["version"];
+                    Cache_.ETag = res->get_header_value("ETag");
+                    Cache_.Predictions += result["predictions"].get<std::string>();
+                    std::cout << Cache_.Predictions << '\n';
                 } else {
                     std::cout << "Erorr\n";
                 }
@@ -74,7 +254,17 @@ public:
 
 
 private:
+
+    struct Cache {
+        size_t Experiment = 0;
+        size_t Version = 0;
+        std::string ETag;
+        std::string Predictions;
+    };
+
     size_t Id_;
+    Cache Cache_;
+    std::string Next_;
 };
 
 class Admin {
@@ -86,7 +276,7 @@ public:
             std::cin >> command;
 
             if (command == "start") {
-                httplib::Client cli(argv[2]);
+                httplib::Client cli = MakeClient(argv[2]);
 
                 json req;
                 req["secret"] = generator.Get();
@@ -101,7 +291,7 @@ public:
             }
 
             if (command == "stop") {
-                httplib::Client cli(argv[2]);
+                httplib::Client cli = MakeClient(argv[2]);
 
                 json req;
                 req["secret"] = generator.Get();
@@ -122,7 +312,7 @@ public:
                 std::string answer;
                 std::cin >> answer;
 
-                httplib::Client cli(argv[2]);
+                httplib::Client cli = MakeClient(argv[2]);
 
                 json req;
                 req["id"] = id;
@@ -140,12 +330,12 @@ public:
             }
 
             if (command == "get") {
-                httplib::Client cli(argv[2]);
+                httplib::Client cli = MakeClient(argv[2]);
 
                 json req;
                 req["secret"] = generator.Get();
 
-                auto res = cli.Post("/admin/get", req.dump(), "application/json");
+                auto res = cli.Post("/admin/get", AcceptEncoding(), req.dump(), "application/json");
                 if (res && res->status == 200) {
                     std::cout << res->body << '\n';
                 } else {
@@ -154,13 +344,82 @@ public:
                 continue;
             }
 
+            // Streams predictions until the next command (or the end of input) arrives.
+            // A stream cut by an overrun or a dropped connection resumes from the last seen seq.
+            if (command == "watch") {
+                bool stopped = false;
+                size_t failures = 0;
+                while (!stopped) {
+                    httplib::Client cli = MakeClient(argv[2]);
+
+                    json body;
+                    body["secret"] = generator.Get();
+                    if (WatchSeq_) {
+                        body["since"] = *WatchSeq_;
+                    }
+
+                    std::string buffer;
+                    httplib::Request req;
+                    req.method = "POST";
+                    req.path = "/admin/watch";
+                    req.body = body.dump();
+                    req.set_header("Content-Type", "application/json");
+                    req.content_receiver = [&](const char* data, size_t size, uint64_t, uint64_t) {
+                        if (HasInput()) {
+                            stopped = true;
+                            return false;
+                        }
+
+                        failures = 0;
+                        buffer.append(data, size);
+                        size_t pos;
+                        while ((pos = buffer.find('\n')) != std::string::npos) {
+                            std::string line = buffer.substr(0, pos);
+                            buffer.erase(0, pos + 1);
+                            if (line.empty()) {
+                                continue;
+                            }
+
+                            auto event = json::parse(line);
+                            if (event.contains("error")) {
+                                std::cout << "Missed predictions, resuming from " << event["oldest"] << '\n';
+                                WatchSeq_ = event["oldest"].get<size_t>();
+                                return false;
+                            }
+                            std::cout << event["id"] << ' ' << event["pred"] << '\n';
+                            WatchSeq_ = event["seq"].get<size_t>() + 1;
+                        }
+                        return true;
+                    };
+
+                    auto res = cli.send(req);
+                    if (stopped) {
+                        break;
+                    }
+                    if (res && res->status == 410) {
+                        WatchSeq_ = json::parse(res->body)["oldest"].get<size_t>();
+                        std::cout << "Missed predictions, resuming from " << *WatchSeq_ << '\n';
+                    } else if (res && res->status != 200) {
+                        std::cout << "Erorr\n";
+                        break;
+                    } else if (!res && res.error() != httplib::Error::Canceled) {
+                        if (++failures == kWatchRetries) {
+                            std::cout << "Erorr\n";
+                            break;
+                        }
+                        std::this_thread::sleep_for(std::chrono::seconds(1));
+                    }
+                }
+                continue;
+            }
+
             if (command == "statistic") {
-                httplib::Client cli(argv[2]);
+                httplib::Client cli = MakeClient(argv[2]);
 
                 json req;
                 req["secret"] = generator.Get();
 
-                auto res = cli.Post("/admin/stat", req.dump(), "application/json");
+                auto res = cli.Post("/admin/stat", AcceptEncoding(), req.dump(), "application/json");
                 if (res && res->status == 200) {
                     std::cout << res->body << '\n';
                 } else {
@@ -175,10 +434,36 @@ public:
 
 private:
 
+    static constexpr size_t kWatchRetries = 3;
+
+    // True once anything but blanks has been typed, or stdin has ended.
+    static bool HasInput() {
+        for (;;) {
+            if (HasQueuedInput()) {
+                return true;
+            }
+            pollfd fd{STDIN_FILENO, POLLIN, 0};
+            if (::poll(&fd, 1, 0) <= 0) {
+                return false;
+            }
+            if (std::cin.rdbuf()->sgetc() == std::char_traits<char>::eof()) {
+                return true;
+            }
+        }
+    }
+
+    static httplib::Headers AcceptEncoding() {
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+        return {{"Accept-Encoding", "gzip"}};
+#else
+        return {};
+#endif
+    }
+
     class Generator {
     public:
         size_t Get() {
-            return ++seed;
+            return seed += 2;
         }
 
     private:
@@ -186,6 +471,7 @@ private:
     };
 
     Generator generator;
+    std::optional<size_t> WatchSeq_;
 };
 
 int main(int argc, char* argv[]) {
@@ -194,12 +480,32 @@ int main(int argc, char* argv[]) {
         httplib::Server svr;
 
         svr.Post("/notify", [&](const httplib::Request& req, httplib::Response& res) {
+            if (IsJson(req.get_header_value("Content-Type"))) {
+                json batch = json::parse(req.body, nullptr, false);
+                if (batch.is_array()) {
+                    for (const auto& message : batch) {
+                        std::cout << (message.is_string() ? message.get<std::string>() : message.dump()) << '\n';
+                    }
+                    return;
+                }
+            }
             std::cout << req.body << '\n';
         });
 
-        svr.listen("0.0.0.0", std::atoi(argv[1]));
+        std::string address = argv[1];
+        if (IsUnix(address)) {
+            std::string path = address.substr(kUnixPrefix.size());
+            ::unlink(path.c_str());
+            svr.set_address_family(AF_UNIX);
+            svr.listen(path, 80);
+        } else {
+            svr.listen("0.0.0.0", std::atoi(argv[1]));
+        }
     }};
 
+    InputBuffer input;
+    std::cin.rdbuf(&input);
+
     std::string permission;
     std::cout << "Input yours permission:\n";
     std::cin >> permission;
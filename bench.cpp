@@ -0,0 +1,691 @@
+#undef _FORTIFY_SOURCE
+#define SERVER_NO_MAIN
+
+#include "server.cpp"
+
+#include <random>
+#include <array>
+#include <thread>
+
+#include <dlfcn.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+// Counters for `bench requests`. Allocations and syscalls made by the benchmark's own client
+// thread are not counted, so the numbers are the server's cost per request.
+namespace NBench {
+    enum Call {
+        Read,
+        Write,
+        Writev,
+        Send,
+        Sendmsg,
+        Recv,
+        Recvmsg,
+        Poll,
+        EpollWait,
+        EpollCtl,
+        Accept4,
+        Close,
+        kCallCount,
+    };
+
+    constexpr const char* kCallNames[kCallCount] = {
+        "read", "write", "writev", "send", "sendmsg", "recv", "recvmsg",
+        "poll", "epoll_wait", "epoll_ctl", "accept4", "close",
+    };
+
+    inline thread_local bool client_ = false;
+    inline std::atomic<uint64_t> allocations_{0};
+    inline std::array<std::atomic<uint64_t>, kCallCount> calls_{};
+
+    template <typename Function>
+    Function* Next(const char* name) {
+        return reinterpret_cast<Function*>(::dlsym(RTLD_NEXT, name));
+    }
+
+    inline void Count(Call call) {
+        if (!client_) {
+            calls_[call].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+// Out of line, so GCC does not pair an inlined free() with a library operator new.
+[[gnu::noinline]] void* operator new(size_t size) {
+    if (!NBench::client_) {
+        NBench::allocations_.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (void* data = std::malloc(size ? size : 1)) {
+        return data;
+    }
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* data) noexcept {
+    std::free(data);
+}
+
+[[gnu::noinline]] void operator delete(void* data, size_t) noexcept {
+    std::free(data);
+}
+
+// The server's calls resolve to these definitions because they live in the same executable;
+// each one counts the call and forwards it to libc.
+#define BENCH_FORWARD(name, call, ...)                                          \
+    static auto* next = NBench::Next<decltype(::name)>(#name);                 \
+    NBench::Count(NBench::call);                                                \
+    return next(__VA_ARGS__)
+
+extern "C" {
+    ssize_t read(int fd, void* data, size_t size) {
+        BENCH_FORWARD(read, Read, fd, data, size);
+    }
+
+    ssize_t write(int fd, const void* data, size_t size) {
+        BENCH_FORWARD(write, Write, fd, data, size);
+    }
+
+    ssize_t writev(int fd, const iovec* iov, int count) {
+        BENCH_FORWARD(writev, Writev, fd, iov, count);
+    }
+
+    ssize_t send(int fd, const void* data, size_t size, int flags) {
+        BENCH_FORWARD(send, Send, fd, data, size, flags);
+    }
+
+    ssize_t sendmsg(int fd, const msghdr* message, int flags) {
+        BENCH_FORWARD(sendmsg, Sendmsg, fd, message, flags);
+    }
+
+    ssize_t recv(int fd, void* data, size_t size, int flags) {
+        BENCH_FORWARD(recv, Recv, fd, data, size, flags);
+    }
+
+    ssize_t recvmsg(int fd, msghdr* message, int flags) {
+        BENCH_FORWARD(recvmsg, Recvmsg, fd, message, flags);
+    }
+
+    int poll(pollfd* fds, nfds_t count, int timeout) {
+        BENCH_FORWARD(poll, Poll, fds, count, timeout);
+    }
+
+    int epoll_wait(int epfd, epoll_event* events, int max_events, int timeout) {
+        BENCH_FORWARD(epoll_wait, EpollWait, epfd, events, max_events, timeout);
+    }
+
+    int epoll_ctl(int epfd, int op, int fd, epoll_event* event) noexcept {
+        BENCH_FORWARD(epoll_ctl, EpollCtl, epfd, op, fd, event);
+    }
+
+    int accept4(int fd, sockaddr* addr, socklen_t* length, int flags) {
+        BENCH_FORWARD(accept4, Accept4, fd, addr, length, flags);
+    }
+
+    int close(int fd) {
+        BENCH_FORWARD(close, Close, fd);
+    }
+}
+
+using BenchClock = std::chrono::steady_clock;
+
+template <typename Function>
+double MeanMs(size_t repeats, Function function) {
+    auto start = BenchClock::now();
+    for (size_t i = 0; i < repeats; ++i) {
+        function();
+    }
+    return std::chrono::duration<double, std::milli>(BenchClock::now() - start).count() / repeats;
+}
+
+// 1000 users with 0-2000 predictions each, normally distributed around a per-user centre.
+std::unordered_map<size_t, std::vector<int>> MakeDataset(size_t* total) {
+    std::mt19937 random(1);
+    std::unordered_map<size_t, std::vector<int>> predictions;
+    *total = 0;
+    for (size_t user = 0; user < 1000; ++user) {
+        std::normal_distribution<double> values(std::uniform_int_distribution<int>(-1000, 1000)(random), 20);
+        size_t count = std::uniform_int_distribution<size_t>(0, 2000)(random);
+        auto& vect = predictions[user];
+        for (size_t i = 0; i < count; ++i) {
+            vect.push_back(static_cast<int>(values(random)));
+        }
+        *total += count;
+    }
+    return predictions;
+}
+
+int BenchCodec() {
+    size_t total;
+    auto predictions = MakeDataset(&total);
+    auto now = Segment::Clock::now();
+    Segment segment(0, now, now, predictions);
+
+    for (size_t i = 0; i < segment.GetUserCount(); ++i) {
+        std::vector<int> values;
+        segment.ForEachBlock(i, [&](const int* begin, const int* end) {
+            values.insert(values.end(), begin, end);
+        });
+        if (values != predictions[segment.GetUser(i)]) {
+            std::cerr << "segment does not round-trip user " << segment.GetUser(i) << '\n';
+            return 1;
+        }
+    }
+
+    long long checksum = 0;
+    double decode_ms = MeanMs(20, [&] {
+        for (size_t i = 0; i < segment.GetUserCount(); ++i) {
+            segment.ForEachBlock(i, [&](const int* begin, const int*) {
+                checksum += *begin;
+            });
+        }
+    });
+
+    std::cout << "values: " << total << '\n'
+              << "raw int32: " << sizeof(int) << " bytes/prediction\n"
+              << "segment: " << static_cast<double>(segment.GetBytes()) / total << " bytes/prediction\n"
+              << "decode: " << decode_ms << " ms (check " << checksum << ")\n";
+    return 0;
+}
+
+// Writes the file back and evicts it from the page cache.
+void DropCache(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    ::fdatasync(fd);
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+}
+
+int BenchSegments(size_t repeats) {
+    size_t total;
+    auto predictions = MakeDataset(&total);
+    auto now = Segment::Clock::now();
+    std::string dir = (std::filesystem::temp_directory_path() / ("bench-segments-" + std::to_string(::getpid()))).string();
+
+    struct Run {
+        const char* Name;
+        size_t Budget;
+        bool Cold;
+    };
+
+    // A budget of zero drops the segment from memory once it is written, so every read maps the file.
+    // A cold read also evicts the file from the page cache first, so the mapping faults it in from disk.
+    for (const Run& run : {Run{"resident", SIZE_MAX, false}, Run{"mapped", 0, false}, Run{"cold", 0, true}}) {
+        std::filesystem::remove_all(dir);
+        SegmentCatalog catalog(dir, run.Budget);
+        auto segment = std::make_shared<const Segment>(0, now, now, predictions);
+        catalog.Add(segment);
+        catalog.Persist(*segment);
+        segment.reset();
+
+        std::string buffer;
+        double ms = 0;
+        rusage before;
+        ::getrusage(RUSAGE_SELF, &before);
+        for (size_t repeat = 0; repeat < repeats; ++repeat) {
+            if (run.Cold) {
+                DropCache(dir + "/0.seg");
+            }
+            ms += MeanMs(1, [&] {
+                for (const auto& stored : catalog.Range(0, 0)) {
+                    for (size_t i = 0; i < stored->GetUserCount(); ++i) {
+                        buffer.clear();
+                        stored->GetPredictions(i, &buffer);
+                    }
+                }
+            });
+        }
+        rusage after;
+        ::getrusage(RUSAGE_SELF, &after);
+        std::cout << run.Name << ": " << ms / repeats << " ms to read " << total << " predictions, "
+                  << static_cast<double>(after.ru_majflt - before.ru_majflt) / repeats << " major faults\n";
+    }
+    std::filesystem::remove_all(dir);
+    return 0;
+}
+
+int BenchKernels() {
+    std::mt19937 random(1);
+    std::vector<int> values(1 << 24);
+    for (auto& value : values) {
+        value = std::uniform_int_distribution<int>(-100000, 100000)(random);
+    }
+
+    std::vector<AggregationKernels> kernels = {AggregationKernels::Scalar()};
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")) {
+        kernels.push_back({"sse4.1", NKernels::SumMinMaxSse4, NKernels::HistogramSse4, NKernels::CountInRangeSse4});
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back({"avx2", NKernels::SumMinMaxAvx2, NKernels::HistogramAvx2, NKernels::CountInRangeAvx2});
+    }
+#endif
+
+    constexpr size_t kRepeats = 20;
+    for (const auto& kernel : kernels) {
+        long long sum = 0;
+        int min = 0;
+        int max = 0;
+        std::vector<size_t> buckets(64);
+        size_t matched = 0;
+        double sum_min_max = MeanMs(kRepeats, [&] {
+            sum = 0;
+            min = std::numeric_limits<int>::max();
+            max = std::numeric_limits<int>::min();
+            kernel.SumMinMax(values.data(), values.size(), &sum, &min, &max);
+        });
+        double histogram = MeanMs(kRepeats, [&] {
+            std::fill(buckets.begin(), buckets.end(), 0);
+            kernel.Histogram(values.data(), values.size(), -100000, 3125, buckets.data(), buckets.size());
+        });
+        double filter = MeanMs(kRepeats, [&] {
+            matched = kernel.CountInRange(values.data(), values.size(), -500, 70000);
+        });
+
+        size_t checksum = matched;
+        for (size_t bucket : buckets) {
+            checksum = checksum * 31 + bucket;
+        }
+        std::cout << kernel.Name << ": sum/min/max " << sum_min_max << " ms, histogram " << histogram
+                  << " ms, filter " << filter << " ms (check " << sum << ' ' << min << ' ' << max << ' ' << checksum << ")\n";
+    }
+    return 0;
+}
+
+int BenchFormat() {
+    std::mt19937 random(1);
+    std::vector<int> values(1000000);
+    for (auto& value : values) {
+        value = std::uniform_int_distribution<int>(-100000, 100000)(random);
+    }
+
+    constexpr size_t kRepeats = 10;
+    std::string streamed;
+    double stream_ms = MeanMs(kRepeats, [&] {
+        std::stringstream out;
+        for (int value : values) {
+            out << value << " ";
+        }
+        streamed = out.str();
+    });
+
+    std::string formatted;
+    double to_chars_ms = MeanMs(kRepeats, [&] {
+        formatted.clear();
+        NFormat::AppendPredictions(values.data(), values.data() + values.size(), &formatted);
+    });
+
+    std::cout << "stringstream: " << stream_ms << " ms\n"
+              << "AppendPredictions: " << to_chars_ms << " ms\n"
+              << "identical: " << (streamed == formatted ? "yes" : "no") << '\n';
+    return streamed == formatted ? 0 : 1;
+}
+
+int BenchRouting() {
+    using Matcher = std::pair<std::unique_ptr<httplib::detail::MatcherBase>, httplib::Server::Handler>;
+    volatile size_t calls = 0;
+    std::vector<Matcher> matchers;
+    std::vector<httplib::Request> requests;
+    for (const auto& route : NRouting::kRoutes) {
+        matchers.emplace_back(std::make_unique<httplib::detail::RegexMatcher>(std::string(route.Path)),
+                              [&](const httplib::Request&, httplib::Response&) { calls = calls + 1; });
+        requests.emplace_back();
+        requests.back().method = route.Method;
+        requests.back().path = route.Path;
+    }
+
+    constexpr size_t kRequests = 200000;
+    httplib::Response res;
+    auto start = BenchClock::now();
+    for (size_t i = 0; i < kRequests; ++i) {
+        auto& req = requests[i % requests.size()];
+        for (auto& [matcher, handler] : matchers) {
+            if (matcher->match(req)) {
+                handler(req, res);
+                break;
+            }
+        }
+    }
+    auto middle = BenchClock::now();
+    for (size_t i = 0; i < kRequests; ++i) {
+        const auto& req = requests[i % requests.size()];
+        if (NRouting::Find(req.method, req.path)) {
+            calls = calls + 1;
+        }
+    }
+    auto stop = BenchClock::now();
+
+    auto ns = [](BenchClock::duration duration) {
+        return std::chrono::duration<double, std::nano>(duration).count() / kRequests;
+    };
+    std::cout << "httplib regex list: " << ns(middle - start) << " ns/request\n"
+              << "perfect hash: " << ns(stop - middle) << " ns/request\n";
+    return 0;
+}
+
+// Keep-alive HTTP/1.1 over a unix socket, written and parsed by hand so the client adds nothing
+// to the server's counters.
+class RawClient {
+public:
+
+    explicit RawClient(std::string path)
+        : path_(std::move(path))
+    {
+        Connect();
+    }
+
+    ~RawClient() {
+        ::close(fd_);
+    }
+
+    int Call(const std::string& request) {
+        for (size_t sent = 0; sent < request.size();) {
+            ssize_t ret = ::send(fd_, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+            if (ret <= 0) {
+                return -1;
+            }
+            sent += ret;
+        }
+
+        size_t head;
+        while ((head = buffer_.find("\r\n\r\n")) == std::string::npos) {
+            if (!Receive()) {
+                return -1;
+            }
+        }
+        std::string_view headers(buffer_.data(), head);
+        int status = std::atoi(buffer_.c_str() + 9);
+
+        size_t end;
+        if (headers.find("Transfer-Encoding: chunked") != std::string_view::npos) {
+            while ((end = buffer_.find("\r\n0\r\n\r\n", head)) == std::string::npos) {
+                if (!Receive()) {
+                    return -1;
+                }
+            }
+            end += 7;
+        } else {
+            size_t length = headers.find("Content-Length: ");
+            end = head + 4 + (length == std::string_view::npos ? 0 : std::strtoull(buffer_.c_str() + length + 16, nullptr, 10));
+            while (buffer_.size() < end) {
+                if (!Receive()) {
+                    return -1;
+                }
+            }
+        }
+
+        bool close = headers.find("Connection: close") != std::string_view::npos;
+        buffer_.erase(0, end);
+        if (close) {
+            ::close(fd_);
+            Connect();
+        }
+        return status;
+    }
+
+private:
+
+    void Connect() {
+        fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        std::copy(path_.begin(), path_.end(), addr.sun_path);
+        while (::connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        buffer_.clear();
+    }
+
+    bool Receive() {
+        char data[65536];
+        ssize_t ret = ::recv(fd_, data, sizeof(data), 0);
+        if (ret <= 0) {
+            return false;
+        }
+        buffer_.append(data, ret);
+        return true;
+    }
+
+    std::string path_;
+    int fd_ = -1;
+    std::string buffer_;
+};
+
+std::string MakeRequest(std::string_view path, const std::string& body, std::string_view extra_headers = "") {
+    return "POST " + std::string(path) + " HTTP/1.1\r\nHost: bench\r\nContent-Type: application/json\r\n" +
+           std::string(extra_headers) + "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+int BenchRequests(const std::string& kind, size_t count, bool gzip) {
+    if (kind != "predict" && kind != "get") {
+        std::cerr << "request kind must be predict or get\n";
+        return 1;
+    }
+
+    std::string tag = std::to_string(::getpid());
+    std::string dir = (std::filesystem::temp_directory_path() / ("bench-history-" + tag)).string();
+    std::string socket_path = (std::filesystem::temp_directory_path() / ("bench-" + tag + ".sock")).string();
+
+    HttpServer server(dir, 64 << 20, 0, 0);
+    Listener listener;
+    listener.new_task_queue = [] {
+        return new httplib::ThreadPool(2, 1000);
+    };
+    listener.Route(&server);
+    listener.set_address_family(AF_UNIX);
+    std::thread loop([&] {
+        listener.listen(socket_path, 80);
+    });
+
+    int status = 0;
+    std::thread client([&] {
+        NBench::client_ = true;
+        RawClient cli(socket_path);
+        cli.Call(MakeRequest("/user/register", "{\"host\":\"localhost:9\"}"));
+        if (cli.Call(MakeRequest("/admin/start", "{\"secret\":2}")) != 200) {
+            status = 1;
+            return;
+        }
+
+        // Requests are built up front. /user/get asks for the last few predictions stored during
+        // the warm-up; with gzip it asks for all of them, so the body is big enough to be compressed.
+        std::vector<std::string> requests;
+        for (size_t i = 0; i < 16; ++i) {
+            if (kind == "predict") {
+                requests.push_back(MakeRequest("/user/predict", "{\"id\":0,\"pred\":" + std::to_string(i * 977) + "}"));
+            } else if (gzip) {
+                requests.push_back(MakeRequest("/user/get", "{\"id\":0}", "Accept-Encoding: gzip\r\n"));
+            } else {
+                requests.push_back(MakeRequest("/user/get", "{\"id\":0,\"since\":" + std::to_string(990 + i % 10) + "}"));
+            }
+        }
+        auto warm_up = MakeRequest("/user/predict", "{\"id\":0,\"pred\":1}");
+        for (size_t i = 0; i < 1000; ++i) {
+            cli.Call(warm_up);
+        }
+
+        uint64_t allocations = NBench::allocations_.load();
+        std::array<uint64_t, NBench::kCallCount> calls;
+        for (size_t i = 0; i < calls.size(); ++i) {
+            calls[i] = NBench::calls_[i].load();
+        }
+        size_t failed = 0;
+        auto start = BenchClock::now();
+        for (size_t i = 0; i < count; ++i) {
+            failed += cli.Call(requests[i % requests.size()]) != 200;
+        }
+        double us = std::chrono::duration<double, std::micro>(BenchClock::now() - start).count();
+
+        std::cout << kind << (gzip ? " (gzip)" : "") << ", " << count << " keep-alive requests"
+                  << (failed ? ", " + std::to_string(failed) + " failed" : "") << '\n'
+                  << "time: " << us / count << " us/request\n"
+                  << "allocations: " << static_cast<double>(NBench::allocations_.load() - allocations) / count << "/request\n";
+        std::cout << "syscalls/request:";
+        double total = 0;
+        for (size_t i = 0; i < calls.size(); ++i) {
+            double per_request = static_cast<double>(NBench::calls_[i].load() - calls[i]) / count;
+            if (per_request > 0) {
+                std::cout << ' ' << NBench::kCallNames[i] << ' ' << per_request;
+            }
+            total += per_request;
+        }
+        std::cout << ", total " << total << '\n';
+        status = failed ? 1 : 0;
+    });
+
+    client.join();
+    listener.stop();
+    loop.join();
+    std::filesystem::remove_all(dir);
+    ::unlink(socket_path.c_str());
+    return status;
+}
+
+int BenchLoad(const std::string& address, size_t clients, size_t seconds, bool keep_alive,
+              const std::string& path, const std::string& body) {
+    std::atomic<uint64_t> ok{0};
+    std::atomic<uint64_t> failed{0};
+    std::atomic<bool> stop{false};
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < clients; ++i) {
+        threads.emplace_back([&] {
+            NBench::client_ = true;
+            std::unique_ptr<httplib::Client> cli;
+            if (NHttp::IsUnix(address)) {
+                cli = std::make_unique<httplib::Client>(address.substr(NHttp::kUnixPrefix.size()), 80);
+                cli->set_address_family(AF_UNIX);
+            } else {
+                cli = std::make_unique<httplib::Client>(address);
+            }
+            cli->set_keep_alive(keep_alive);
+            cli->set_tcp_nodelay(true);
+            while (!stop) {
+                auto res = cli->Post(path, body, "application/json");
+                (res && res->status == 200 ? ok : failed).fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    stop = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    std::cout << static_cast<double>(ok) / seconds << " req/s (" << ok << " ok, " << failed << " failed)\n";
+    return 0;
+}
+// Opens `connections` keep-alive connections to an in-process server, sends one request on each
+// and leaves them idle; the process CPU time over the hold is what the idle connections cost.
+int BenchIdle(size_t connections, size_t seconds) {
+    rlimit limit;
+    ::getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    ::setrlimit(RLIMIT_NOFILE, &limit);
+
+    std::string dir = (std::filesystem::temp_directory_path() / ("bench-idle-" + std::to_string(::getpid()))).string();
+    HttpServer server(dir, 64 << 20, 0, 0);
+    Listener listener;
+    listener.new_task_queue = [] {
+        return new httplib::ThreadPool(8, 100000);
+    };
+    listener.set_keep_alive_timeout(seconds + 10);
+    listener.Route(&server);
+    int port = listener.bind_to_any_port("127.0.0.1");
+    std::thread loop([&] {
+        listener.listen_after_bind();
+    });
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    std::string request = "GET /idle HTTP/1.1\r\nHost: bench\r\n\r\n";
+
+    std::vector<int> socks;
+    for (size_t i = 0; i < connections; ++i) {
+        int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            ::send(fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+            std::cerr << "connection " << i << ": " << std::strerror(errno) << '\n';
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            break;
+        }
+        socks.push_back(fd);
+    }
+
+    size_t answered = 0;
+    for (int fd : socks) {
+        char data[4096];
+        answered += ::recv(fd, data, sizeof(data), 0) > 0;
+    }
+
+    auto cpu = [] {
+        rusage usage;
+        ::getrusage(RUSAGE_SELF, &usage);
+        return std::chrono::seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+               std::chrono::microseconds(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+    };
+    auto before = cpu();
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    double used = std::chrono::duration<double, std::milli>(cpu() - before).count() / seconds;
+
+    std::cout << answered << " idle keep-alive connections: " << used << " ms CPU per second ("
+              << used / 10 << "% of a core)\n";
+
+    for (int fd : socks) {
+        ::close(fd);
+    }
+    listener.stop();
+    loop.join();
+    std::filesystem::remove_all(dir);
+    return answered == connections ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    std::string command = argc > 1 ? argv[1] : "";
+    if (command == "codec") {
+        return BenchCodec();
+    }
+    if (command == "segments") {
+        return BenchSegments(argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 20);
+    }
+    if (command == "kernels") {
+        return BenchKernels();
+    }
+    if (command == "format") {
+        return BenchFormat();
+    }
+    if (command == "routing") {
+        return BenchRouting();
+    }
+    if (command == "requests" && argc > 2) {
+        return BenchRequests(argv[2], argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 20000,
+                             argc > 4 && std::string_view(argv[4]) == "gzip");
+    }
+    if (command == "load" && argc > 4) {
+        return BenchLoad(argv[2], std::strtoull(argv[3], nullptr, 10), std::strtoull(argv[4], nullptr, 10),
+                         argc > 5 && std::atoi(argv[5]) != 0, argc > 6 ? argv[6] : "/user/get",
+                         argc > 7 ? argv[7] : "{\"id\":0}");
+    }
+    if (command == "idle") {
+        return BenchIdle(argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 5000,
+                         argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 10);
+    }
+
+    std::cerr << "usage: " << argv[0] << " codec | segments [<repeats>] | kernels | format | routing\n"
+              << "       " << argv[0] << " requests <predict|get> [<count>] [gzip]\n"
+              << "       " << argv[0] << " load <server> <clients> <seconds> [<keep_alive>] [<path>] [<body>]\n"
+              << "       " << argv[0] << " idle [<connections>] [<seconds>]\n";
+    return 1;
+}
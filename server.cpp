@@ -1,12 +1,50 @@
+#define CPPHTTPLIB_LISTEN_BACKLOG 1024
+#define CPPHTTPLIB_USE_POLL
+
 #include "httplib.h"
 #include "json.hpp"
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <sstream>
+#include <charconv>
 #include <vector>
 #include <mutex>
 #include <unordered_map>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <shared_mutex>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <map>
+#include <limits>
+#include <algorithm>
+#include <list>
+#include <deque>
+#include <fstream>
+#include <cstdio>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#ifdef SERVER_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 
 using json = nlohmann::json;
 
@@ -34,371 +72,4404 @@ bool CheckSecret(size_t secret) {
 
 namespace NExperiment {
     static char* self_ = nullptr;
+    static size_t next_id_ = 0;
+    static size_t user_quota_ = 0;
+    static size_t experiment_quota_ = 0;
+    static bool evict_ = false;
 }
 
-class Experiment {
+class BlockCodec {
 public:
 
-    void RegisterUser(size_t id) {
-        predictions_[id] = {};
+    static constexpr size_t kBlockSize = 128;
+
+    static void Encode(const int* begin, const int* end, std::vector<uint32_t>* out) {
+        for (; begin < end; begin += std::min<size_t>(kBlockSize, end - begin)) {
+            size_t count = std::min<size_t>(kBlockSize, end - begin);
+            auto [min, max] = std::minmax_element(begin, begin + count);
+            uint32_t range = static_cast<uint32_t>(*max) - static_cast<uint32_t>(*min);
+            uint32_t bits = range ? 32 - __builtin_clz(range) : 0;
+
+            out->push_back(static_cast<uint32_t>(*min));
+            out->push_back(bits);
+
+            size_t first = out->size();
+            out->resize(first + Words(count, bits), 0);
+            if (!bits) {
+                continue;
+            }
+            uint32_t* words = out->data() + first;
+            for (size_t i = 0; i < count; ++i) {
+                uint64_t delta = static_cast<uint32_t>(begin[i]) - static_cast<uint32_t>(*min);
+                size_t pos = i * bits;
+                words[pos >> 5] |= static_cast<uint32_t>(delta << (pos & 31));
+                words[(pos >> 5) + 1] |= static_cast<uint32_t>((delta << (pos & 31)) >> 32);
+            }
+        }
     }
 
-    bool IsRegistered(size_t id) {
-        return predictions_.find(id) != predictions_.end();
+    static const uint32_t* DecodeBlock(const uint32_t* in, size_t count, int* out) {
+        uint32_t base = in[0];
+        uint32_t bits = in[1];
+        const uint32_t* words = in + 2;
+        if (!bits) {
+            std::fill(out, out + count, static_cast<int>(base));
+            return words + Words(count, bits);
+        }
+        static const auto unpack = DetectUnpack();
+        unpack(words, count, bits, base, out);
+        return words + Words(count, bits);
     }
 
-    void AddPrediction(size_t id, int num) {
-        predictions_[id].push_back(num);
+    // True when count values are encoded in exactly size words starting at in.
+    static bool Check(const uint32_t* in, size_t size, size_t count) {
+        const uint32_t* end = in + size;
+        while (count) {
+            size_t n = std::min(count, kBlockSize);
+            if (end - in < 2 || in[1] > 32 || static_cast<size_t>(end - in) - 2 < Words(n, in[1])) {
+                return false;
+            }
+            in += 2 + Words(n, in[1]);
+            count -= n;
+        }
+        return in == end;
     }
 
-    std::string GetPredictions(size_t id) {
-        std::stringstream ss;
-        for (int i : predictions_[id]) {
-            ss << i << " ";
+    template <typename F>
+    static void Decode(const uint32_t* in, size_t count, F&& f) {
+        int block[kBlockSize];
+        while (count) {
+            size_t n = std::min(count, kBlockSize);
+            in = DecodeBlock(in, n, block);
+            f(block, block + n);
+            count -= n;
         }
+    }
 
-        return ss.str();
+private:
+
+    using Unpack = void (*)(const uint32_t* words, size_t count, uint32_t bits, uint32_t base, int* out);
+
+    static size_t Words(size_t count, uint32_t bits) {
+        return (count * bits + 31) / 32 + 1;
     }
 
-    void Flush(std::unordered_map<size_t, std::vector<int>>* predictions) {
-        for (const auto& [id, vect] : predictions_) {
-            for (int i : vect) {
-                (*predictions)[id].push_back(i);
-            }
+    // Unpacks values [first, count); the padding word lets every value read the word after its own.
+    static void UnpackScalar(const uint32_t* words, size_t first, size_t count, uint32_t bits, uint32_t base, int* out) {
+        uint64_t mask = (uint64_t{1} << bits) - 1;
+        for (size_t i = first; i < count; ++i) {
+            size_t pos = i * bits;
+            uint64_t pair = words[pos >> 5] | (static_cast<uint64_t>(words[(pos >> 5) + 1]) << 32);
+            out[i] = static_cast<int>(base + static_cast<uint32_t>((pair >> (pos & 31)) & mask));
         }
     }
 
-    static bool IsActive() {
-        return NExperiment::self_ != nullptr;
+    static void UnpackScalar(const uint32_t* words, size_t count, uint32_t bits, uint32_t base, int* out) {
+        UnpackScalar(words, 0, count, bits, base, out);
     }
 
-    static void Init() {
-        NExperiment::self_ = reinterpret_cast<char*>(new Experiment{});
+#if defined(__x86_64__) || defined(__i386__)
+    // Eight values per step: gather the word holding each value and the one after it, then
+    // shift both halves into place with per-lane variable shifts.
+    __attribute__((target("avx2")))
+    static void UnpackAvx2(const uint32_t* words, size_t count, uint32_t bits, uint32_t base, int* out) {
+        const int* from = reinterpret_cast<const int*>(words);
+        __m256i step = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(bits));
+        __m256i mask = _mm256_set1_epi32(static_cast<int>((uint64_t{1} << bits) - 1));
+        __m256i b = _mm256_set1_epi32(static_cast<int>(base));
+        __m256i width = _mm256_set1_epi32(32);
+        __m256i low = _mm256_set1_epi32(31);
+
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m256i pos = _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(i * bits)), step);
+            __m256i index = _mm256_srli_epi32(pos, 5);
+            __m256i shift = _mm256_and_si256(pos, low);
+            __m256i lo = _mm256_srlv_epi32(_mm256_i32gather_epi32(from, index, 4), shift);
+            __m256i hi = _mm256_sllv_epi32(_mm256_i32gather_epi32(from + 1, index, 4), _mm256_sub_epi32(width, shift));
+            __m256i v = _mm256_add_epi32(_mm256_and_si256(_mm256_or_si256(lo, hi), mask), b);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), v);
+        }
+        UnpackScalar(words, i, count, bits, base, out);
     }
+#endif
 
-    static void Destoy() {
-        delete NExperiment::self_;
+    static Unpack DetectUnpack() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return UnpackAvx2;
+        }
+#endif
+        return UnpackScalar;
     }
+};
 
-    static Experiment* Get() {
-        return reinterpret_cast<Experiment*>(NExperiment::self_);
+namespace NKernels {
+    inline void SumMinMaxScalar(const int* data, size_t size, long long* sum, int* min, int* max) {
+        long long s = 0;
+        int lo = *min;
+        int hi = *max;
+        for (size_t i = 0; i < size; ++i) {
+            s += data[i];
+            lo = std::min(lo, data[i]);
+            hi = std::max(hi, data[i]);
+        }
+        *sum += s;
+        *min = lo;
+        *max = hi;
     }
 
-private:
-    std::unordered_map<size_t, std::vector<int>> predictions_;
-};
+    inline void HistogramScalar(const int* data, size_t size, long long base, long long width,
+                                size_t* buckets, size_t count) {
+        for (size_t i = 0; i < size; ++i) {
+            long long diff = data[i] - base;
+            if (diff >= 0 && static_cast<unsigned long long>(diff / width) < count) {
+                ++buckets[diff / width];
+            }
+        }
+    }
 
-class HttpServer {
-public:
+    inline size_t CountInRangeScalar(const int* data, size_t size, int lo, int hi) {
+        size_t matched = 0;
+        for (size_t i = 0; i < size; ++i) {
+            matched += lo <= data[i] && data[i] <= hi;
+        }
+        return matched;
+    }
 
-    struct User {
-        size_t Id;
-        std::string Address;
-    };
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("sse4.1")))
+    inline void SumMinMaxSse4(const int* data, size_t size, long long* sum, int* min, int* max) {
+        __m128i acc = _mm_setzero_si128();
+        __m128i lo = _mm_set1_epi32(*min);
+        __m128i hi = _mm_set1_epi32(*max);
 
-    size_t Push(std::string address) {
-        std::lock_guard<std::mutex> lock(mtx_);
+        size_t i = 0;
+        for (; i + 4 <= size; i += 4) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            acc = _mm_add_epi64(acc, _mm_cvtepi32_epi64(v));
+            acc = _mm_add_epi64(acc, _mm_cvtepi32_epi64(_mm_srli_si128(v, 8)));
+            lo = _mm_min_epi32(lo, v);
+            hi = _mm_max_epi32(hi, v);
+        }
 
-        std::cout << address << '\n';
+        alignas(16) long long sums[2];
+        alignas(16) int mins[4];
+        alignas(16) int maxs[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(sums), acc);
+        _mm_store_si128(reinterpret_cast<__m128i*>(mins), lo);
+        _mm_store_si128(reinterpret_cast<__m128i*>(maxs), hi);
 
-        size_t id = users_.size();
-        users_.push_back({
-            .Id = id,
-            .Address = std::move(address)
-        });
-        return id;
+        *sum += sums[0] + sums[1];
+        *min = *std::min_element(mins, mins + 4);
+        *max = *std::max_element(maxs, maxs + 4);
+        SumMinMaxScalar(data + i, size - i, sum, min, max);
     }
 
-    void Start() {
-        std::lock_guard<std::mutex> lock(mtx_);
-        Experiment::Init();
+    __attribute__((target("sse4.1")))
+    inline void HistogramSse4(const int* data, size_t size, long long base, long long width,
+                              size_t* buckets, size_t count) {
+        __m128d b = _mm_set1_pd(static_cast<double>(base));
+        __m128d w = _mm_set1_pd(static_cast<double>(width));
+        __m128d zero = _mm_setzero_pd();
+        __m128d limit = _mm_set1_pd(static_cast<double>(count));
 
-        for (auto& user : users_) {
-            Experiment::Get()->RegisterUser(user.Id);
+        size_t i = 0;
+        for (; i + 2 <= size; i += 2) {
+            __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(data + i));
+            __m128d q = _mm_floor_pd(_mm_div_pd(_mm_sub_pd(_mm_cvtepi32_pd(v), b), w));
+            int mask = _mm_movemask_pd(_mm_and_pd(_mm_cmpge_pd(q, zero), _mm_cmplt_pd(q, limit)));
 
-            httplib::Client cli(user.Address);
-            auto _ = cli.Post("/notify", "Experiment is started!", "text/plain");
+            alignas(16) double index[2];
+            _mm_store_pd(index, q);
+            for (int lane = 0; lane < 2; ++lane) {
+                if (mask & (1 << lane)) {
+                    ++buckets[static_cast<size_t>(index[lane])];
+                }
+            }
         }
+        HistogramScalar(data + i, size - i, base, width, buckets, count);
     }
 
-    void Stop() {
-        Experiment::Get()->Flush(&stat_);
-        Experiment::Destoy();
+    __attribute__((target("sse4.1")))
+    inline size_t CountInRangeSse4(const int* data, size_t size, int lo, int hi) {
+        __m128i l = _mm_set1_epi32(lo);
+        __m128i h = _mm_set1_epi32(hi);
+
+        size_t matched = 0;
+        size_t i = 0;
+        for (; i + 4 <= size; i += 4) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            __m128i out = _mm_or_si128(_mm_cmplt_epi32(v, l), _mm_cmpgt_epi32(v, h));
+            matched += 4 - __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(out)));
+        }
+        return matched + CountInRangeScalar(data + i, size - i, lo, hi);
     }
 
+    __attribute__((target("avx2")))
+    inline void SumMinMaxAvx2(const int* data, size_t size, long long* sum, int* min, int* max) {
+        __m256i acc = _mm256_setzero_si256();
+        __m256i lo = _mm256_set1_epi32(*min);
+        __m256i hi = _mm256_set1_epi32(*max);
 
-    void RegisterUser(const httplib::Request& req, httplib::Response& res) {
-        json request;
-        try { 
-            request = json::parse(req.body);
-        } catch (json::exception&) {
-            res.status = 400;
-            return;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+            acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+            lo = _mm256_min_epi32(lo, v);
+            hi = _mm256_max_epi32(hi, v);
         }
 
-        size_t id = Push(request["host"]);
+        alignas(32) long long sums[4];
+        alignas(32) int mins[8];
+        alignas(32) int maxs[8];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(sums), acc);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(mins), lo);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(maxs), hi);
 
-        res.status = 200;
-        json response;
-        response["id"] = id;
-        res.set_content(response.dump(), "application/json");
-        
+        *sum += sums[0] + sums[1] + sums[2] + sums[3];
+        *min = *std::min_element(mins, mins + 8);
+        *max = *std::max_element(maxs, maxs + 8);
+        SumMinMaxScalar(data + i, size - i, sum, min, max);
     }
 
-    void RegisterPrediction(const httplib::Request& req, httplib::Response& res) {
-        json request;
-        try {
-            request = json::parse(req.body);
-        } catch (json::exception&) {
-            res.status = 400;
-            return;
-        }
+    __attribute__((target("avx2")))
+    inline void HistogramAvx2(const int* data, size_t size, long long base, long long width,
+                              size_t* buckets, size_t count) {
+        __m256d b = _mm256_set1_pd(static_cast<double>(base));
+        __m256d w = _mm256_set1_pd(static_cast<double>(width));
+        __m256d zero = _mm256_setzero_pd();
+        __m256d limit = _mm256_set1_pd(static_cast<double>(count));
 
-        int pred = request["pred"];
-        size_t id = request["id"];
+        size_t i = 0;
+        for (; i + 4 <= size; i += 4) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            __m256d q = _mm256_floor_pd(_mm256_div_pd(_mm256_sub_pd(_mm256_cvtepi32_pd(v), b), w));
+            __m256d in = _mm256_and_pd(_mm256_cmp_pd(q, zero, _CMP_GE_OQ), _mm256_cmp_pd(q, limit, _CMP_LT_OQ));
+            int mask = _mm256_movemask_pd(in);
 
-        std::lock_guard<std::mutex> lock(exp_mtx_);
-        if (!Experiment::IsActive() || !Experiment::Get()->IsRegistered(id)) {
-            res.status = 400;
-            return;
+            alignas(32) double index[4];
+            _mm256_store_pd(index, q);
+            for (int lane = 0; lane < 4; ++lane) {
+                if (mask & (1 << lane)) {
+                    ++buckets[static_cast<size_t>(index[lane])];
+                }
+            }
         }
+        HistogramScalar(data + i, size - i, base, width, buckets, count);
+    }
 
-        Experiment::Get()->AddPrediction(id, pred);
+    __attribute__((target("avx2")))
+    inline size_t CountInRangeAvx2(const int* data, size_t size, int lo, int hi) {
+        __m256i l = _mm256_set1_epi32(lo);
+        __m256i h = _mm256_set1_epi32(hi);
 
-        res.status = 200;
+        size_t matched = 0;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            __m256i out = _mm256_or_si256(_mm256_cmpgt_epi32(l, v), _mm256_cmpgt_epi32(v, h));
+            matched += 8 - __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(out)));
+        }
+        return matched + CountInRangeScalar(data + i, size - i, lo, hi);
     }
+#endif
+}
 
-    void GetPredictions(const httplib::Request& req, httplib::Response& res) {
-        json request;
-        try {
-            request = json::parse(req.body);
-        } catch (json::exception&) {
-            res.status = 400;
-            return;
-        }
+class AggregationKernels {
+public:
 
-        size_t id = request["id"];
+    const char* Name;
+    void (*SumMinMax)(const int* data, size_t size, long long* sum, int* min, int* max);
+    void (*Histogram)(const int* data, size_t size, long long base, long long width, size_t* buckets, size_t count);
+    size_t (*CountInRange)(const int* data, size_t size, int lo, int hi);
 
-        std::lock_guard<std::mutex> lock(exp_mtx_);
-        if (!Experiment::IsActive() || !Experiment::Get()->IsRegistered(id)) {
-            res.status = 400;
-            return;
-        }
+    static const AggregationKernels& Get() {
+        static const AggregationKernels kernels = Detect();
+        return kernels;
+    }
 
-        res.status = 200;
-        json response;
-        response["predictions"] = Experiment::Get()->GetPredictions(id);
-        res.set_content(response.dump(), "application/json");
+    static AggregationKernels Scalar() {
+        return {"scalar", NKernels::SumMinMaxScalar, NKernels::HistogramScalar, NKernels::CountInRangeScalar};
     }
 
-    void StartExperiment(const httplib::Request& req, httplib::Response& res) {
-        json request;
-        try {
-            request = json::parse(req.body);
-        } catch (json::exception&) {
-            res.status = 400;
-            return;
-        }
+private:
 
-        size_t secret = request["secret"];
-        if (!checker_.CheckSecret(secret)) {
-            res.status = 400;
-            return;
+    static AggregationKernels Detect() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return {"avx2", NKernels::SumMinMaxAvx2, NKernels::HistogramAvx2, NKernels::CountInRangeAvx2};
         }
-
-        std::lock_guard<std::mutex> lock(exp_mtx_);
-        if (Experiment::IsActive()) {
-            res.status = 400;
-            return;
+        if (__builtin_cpu_supports("sse4.1")) {
+            return {"sse4.1", NKernels::SumMinMaxSse4, NKernels::HistogramSse4, NKernels::CountInRangeSse4};
         }
-
-        Start();
-        res.status = 200;
+#endif
+        return Scalar();
     }
+};
 
-    void StopExperiment(const httplib::Request& req, httplib::Response& res) {
-        json request;
-        try {
-            request = json::parse(req.body);
-        } catch (json::exception&) {
-            res.status = 400;
-            return;
-        }
-
-        size_t secret = request["secret"];
-        if (!checker_.CheckSecret(secret)) {
-            res.status = 400;
-            return;
-        }
+namespace NFormat {
+    constexpr size_t kMaxPredictionChars = 12;
 
-        std::lock_guard<std::mutex> lock(exp_mtx_);
-        if (!Experiment::IsActive()) {
-            res.status = 400;
-            return;
-        }
+    // Position of the first character at or after pos that is not in blanks (JSON whitespace by default).
+    inline size_t SkipSpace(std::string_view text, size_t pos, std::string_view blanks = " \t\n\r") {
+        return std::min(text.find_first_not_of(blanks, pos), text.size());
+    }
 
-        Stop();
-        res.status = 200;
+    inline bool IsControl(char c) {
+        return static_cast<unsigned char>(c) < 0x20;
     }
 
-    void AnswerToUser(const httplib::Request& req, httplib::Response& res) {
-        json request;
-        try {
-            request = json::parse(req.body);
-        } catch (json::exception&) {
-            res.status = 400;
-            return;
-        }
+    template <typename String>
+    void AppendNumber(uint64_t value, String* out) {
+        char number[24];
+        out->append(number, std::to_chars(number, number + sizeof(number), value).ptr);
+    }
 
-        size_t secret = request["secret"];
-        if (!checker_.CheckSecret(secret)) {
-            res.status = 400;
-            return;
-        }
+    template <typename String>
+    void AppendPredictions(const int* begin, const int* end, String* out) {
+        size_t size = out->size();
+        out->resize(size + (end - begin) * kMaxPredictionChars);
 
-        std::lock_guard<std::mutex> lock(exp_mtx_);
-        if (!Experiment::IsActive()) {
-            res.status = 400;
-            return;
+        char* it = out->data() + size;
+        for (; begin != end; ++begin) {
+            it = std::to_chars(it, it + kMaxPredictionChars, *begin).ptr;
+            *it++ = ' ';
         }
+        out->resize(it - out->data());
+    }
+}
 
-        size_t id = request["id"];
-        std::string ans = request["answer"];
+namespace NJson {
+    class FlatObject {
+    public:
 
-        httplib::Client cli(users_[id].Address);
-        auto _ = cli.Post("/notify", ans, "text/plain");
+        static constexpr size_t kMaxFields = 8;
 
-        res.status = 200;
-    }
+        bool Parse(std::string_view body) {
+            switch (Scan(body)) {
+            case Result::Ok:
+                return true;
+            case Result::Invalid:
+                return false;
+            case Result::Unsupported:
+                break;
+            }
 
-    void GetWaiters(const httplib::Request& req, httplib::Response& res) {
-        json request;
-        try {
-            request = json::parse(req.body);
-        } catch (json::exception&) {
-            res.status = 400;
-            return;
+            size_ = 0;
+            dom_ = json::parse(body.begin(), body.end(), nullptr, false);
+            return dom_.is_object();
         }
 
-        size_t secret = request["secret"];
-        if (!checker_.CheckSecret(secret)) {
-            res.status = 400;
-            return;
-        }
-        
-        std::lock_guard<std::mutex> lock(exp_mtx_);
-        if (!Experiment::IsActive()) {
-            res.status = 400;
-            return;
+        bool Contains(std::string_view name) const {
+            return dom_.is_object() ? dom_.contains(std::string(name)) : Find(name) != nullptr;
         }
 
-        json response;
-        for (auto& user : users_) {
-            if (Experiment::Get()->IsRegistered(user.Id)) {
-                response[std::to_string(user.Id)] = Experiment::Get()->GetPredictions(user.Id);
+        template <typename T>
+        bool Get(std::string_view name, T* value) const {
+            int64_t raw;
+            if (dom_.is_object()) {
+                auto it = dom_.find(std::string(name));
+                if (it == dom_.end() || !it->is_number_integer()) {
+                    return false;
+                }
+                raw = it->get<int64_t>();
+            } else {
+                const Field* field = Find(name);
+                if (!field || !field->IsInteger) {
+                    return false;
+                }
+                raw = field->Value;
             }
-        }
 
-        for (auto& user : users_) {
-            if (Experiment::Get()->IsRegistered(user.Id)) {
-                response[std::to_string(user.Id)] = Experiment::Get()->GetPredictions(user.Id);
+            if (raw < static_cast<int64_t>(std::numeric_limits<T>::min()) ||
+                (raw > 0 && static_cast<uint64_t>(raw) > static_cast<uint64_t>(std::numeric_limits<T>::max()))) {
+                return false;
             }
+            *value = static_cast<T>(raw);
+            return true;
         }
 
-        res.status = 200;
-        res.set_content(response.dump(), "application/json");
-    }
+    private:
 
-    void GetStat(const httplib::Request& req, httplib::Response& res) {
-        json request;
-        try {
-            request = json::parse(req.body);
-        } catch (json::exception&) {
-            res.status = 400;
-            return;
-        }
-        
-        std::lock_guard<std::mutex> lock(exp_mtx_);
-        if (!Experiment::IsActive()) {
-            res.status = 400;
-            return;
-        }
+        enum class Result {
+            Ok,
+            Invalid,
+            Unsupported,
+        };
 
-        size_t secret = request["secret"];
-        if (!checker_.CheckSecret(secret)) {
-            res.status = 400;
-            return;
+        struct Field {
+            std::string_view Name;
+            int64_t Value;
+            bool IsInteger;
+        };
+
+        const Field* Find(std::string_view name) const {
+            for (size_t i = size_; i-- > 0;) {
+                if (fields_[i].Name == name) {
+                    return &fields_[i];
+                }
+            }
+            return nullptr;
         }
 
-        json response;
+        Result Scan(std::string_view body) {
+            using NFormat::SkipSpace;
 
-        for (auto& user : users_) {
-            if (Experiment::Get()->IsRegistered(user.Id)) {
-                response["Current"][std::to_string(user.Id)] = Experiment::Get()->GetPredictions(user.Id);
+            size_ = 0;
+            size_t pos = SkipSpace(body, 0);
+            if (pos == body.size() || body[pos] != '{') {
+                return Result::Unsupported;
             }
-        }
+            pos = SkipSpace(body, pos + 1);
+            if (pos < body.size() && body[pos] == '}') {
+                return SkipSpace(body, pos + 1) == body.size() ? Result::Ok : Result::Invalid;
+            }
+
+            for (;;) {
+                if (pos == body.size() || body[pos] != '"') {
+                    return Result::Invalid;
+                }
+                size_t end = body.find_first_of("\"\\", pos + 1);
+                if (end == std::string_view::npos) {
+                    return Result::Invalid;
+                }
+                if (body[end] == '\\' || size_ == kMaxFields) {
+                    return Result::Unsupported;
+                }
 
-        for (const auto& [id, vect] : stat_) {
-            std::stringstream ss;
-            for (int i : vect) {
-                ss << i << " ";
+                Field& field = fields_[size_++];
+                field = {body.substr(pos + 1, end - pos - 1), 0, false};
+                if (std::any_of(field.Name.begin(), field.Name.end(), NFormat::IsControl)) {
+                    return Result::Invalid;
+                }
+
+                pos = SkipSpace(body, end + 1);
+                if (pos == body.size() || body[pos] != ':') {
+                    return Result::Invalid;
+                }
+                pos = SkipSpace(body, pos + 1);
+                if (pos == body.size()) {
+                    return Result::Invalid;
+                }
+
+                char c = body[pos];
+                if (c == '-' || (c >= '0' && c <= '9')) {
+                    size_t digits = pos + (c == '-');
+                    if (digits + 1 < body.size() && body[digits] == '0' && body[digits + 1] >= '0' && body[digits + 1] <= '9') {
+                        return Result::Invalid;
+                    }
+                    auto [ptr, ec] = std::from_chars(body.data() + pos, body.data() + body.size(), field.Value);
+                    if (ec != std::errc()) {
+                        return Result::Unsupported;
+                    }
+                    pos = ptr - body.data();
+                    if (pos < body.size() && (body[pos] == '.' || body[pos] == 'e' || body[pos] == 'E')) {
+                        return Result::Unsupported;
+                    }
+                    field.IsInteger = true;
+                } else if (c == '"') {
+                    for (++pos; pos < body.size() && body[pos] != '"'; ++pos) {
+                        if (body[pos] == '\\') {
+                            return Result::Unsupported;
+                        }
+                        if (NFormat::IsControl(body[pos])) {
+                            return Result::Invalid;
+                        }
+                    }
+                    if (pos >= body.size()) {
+                        return Result::Invalid;
+                    }
+                    ++pos;
+                } else if (body.compare(pos, 4, "true") == 0 || body.compare(pos, 4, "null") == 0) {
+                    pos += 4;
+                } else if (body.compare(pos, 5, "false") == 0) {
+                    pos += 5;
+                } else if (c == '{' || c == '[') {
+                    return Result::Unsupported;
+                } else {
+                    return Result::Invalid;
+                }
+
+                pos = SkipSpace(body, pos);
+                if (pos == body.size()) {
+                    return Result::Invalid;
+                }
+                if (body[pos] == '}') {
+                    return SkipSpace(body, pos + 1) == body.size() ? Result::Ok : Result::Invalid;
+                }
+                if (body[pos] != ',') {
+                    return Result::Invalid;
+                }
+                pos = SkipSpace(body, pos + 1);
             }
-            response["Old"][std::to_string(id)] = ss.str();
         }
 
-        res.status = 200;
-        res.set_content(response.dump(), "application/json");
-    }
+        std::array<Field, kMaxFields> fields_;
+        size_t size_ = 0;
+        json dom_;
+    };
+}
 
+class Segment {
+public:
 
-private:
+    struct Aggregate {
+        size_t Count = 0;
+        long long Sum = 0;
+        int Min = std::numeric_limits<int>::max();
+        int Max = std::numeric_limits<int>::min();
 
-    std::mutex mtx_;
-    std::mutex exp_mtx_;
-    std::vector<User> users_;
+        void Add(int value) {
+            ++Count;
+            Sum += value;
+            Min = std::min(Min, value);
+            Max = std::max(Max, value);
+        }
 
-    Checker checker_;
+        void Add(const int* begin, const int* end) {
+            Count += end - begin;
+            AggregationKernels::Get().SumMinMax(begin, end - begin, &Sum, &Min, &Max);
+        }
 
-    std::unordered_map<size_t, std::vector<int>> stat_;
-};
+        void Merge(const Aggregate& other) {
+            Count += other.Count;
+            Sum += other.Sum;
+            Min = std::min(Min, other.Min);
+            Max = std::max(Max, other.Max);
+        }
+    };
 
-int main(int argc, char* argv[]) {
-    httplib::Server svr;
-    svr.new_task_queue = [=] { return new httplib::ThreadPool(std::atoi(argv[1]), std::atoi(argv[2])); };
+    using Clock = std::chrono::system_clock;
 
-    HttpServer server;
-    svr.Post("/user/register", [&](const httplib::Request& req, httplib::Response& res) {
-        server.RegisterUser(req, res);
-    });
+    Segment(size_t id, Clock::time_point start, Clock::time_point stop,
+            const std::unordered_map<size_t, std::vector<int>>& predictions,
+            const std::unordered_map<size_t, size_t>& evicted = {})
+    {
+        std::vector<size_t> users;
+        users.reserve(predictions.size());
+        size_t values = 0;
+        for (const auto& [user, vect] : predictions) {
+            users.push_back(user);
+            values += vect.size();
+        }
+        std::sort(users.begin(), users.end());
 
-    svr.Post("/user/predict", [&](const httplib::Request& req, httplib::Response& res) {
-        server.RegisterPrediction(req, res);
-    });
+        std::vector<uint32_t> words;
+        std::vector<size_t> offsets{0};
+        for (size_t user : users) {
+            const auto& vect = predictions.at(user);
+            BlockCodec::Encode(vect.data(), vect.data() + vect.size(), &words);
+            offsets.push_back(words.size());
+        }
 
-    svr.Post("/user/get", [&](const httplib::Request& req, httplib::Response& res) {
-        server.GetPredictions(req, res);
-    });
+        size_ = Layout(users.size(), words.size(), true);
+        buffer_.reset(new uint64_t[(size_ + sizeof(uint64_t) - 1) / sizeof(uint64_t)]);
+        data_ = reinterpret_cast<const char*>(buffer_.get());
+        char* data = reinterpret_cast<char*>(buffer_.get());
 
-    svr.Post("/admin/start", [&](const httplib::Request& req, httplib::Response& res) {
-        server.StartExperiment(req, res);
-    });
+        Header* header = reinterpret_cast<Header*>(data);
+        *header = Header{};
+        header->Magic = kMagicEvicted;
+        header->Id = id;
+        header->Start = Clock::to_time_t(start);
+        header->Stop = Clock::to_time_t(stop);
+        header->Users = users.size();
+        header->Values = values;
+        header->Words = words.size();
+        Bind();
 
-    svr.Post("/admin/stop", [&](const httplib::Request& req, httplib::Response& res) {
-        server.StopExperiment(req, res);
-    });
+        std::copy(users.begin(), users.end(), const_cast<size_t*>(users_));
+        std::copy(offsets.begin(), offsets.end(), const_cast<size_t*>(offsets_));
+        std::copy(words.begin(), words.end(), const_cast<uint32_t*>(words_));
 
-    svr.Post("/admin/answer", [&](const httplib::Request& req, httplib::Response& res) {
-        server.AnswerToUser(req, res);
-    });
+        Aggregate* aggregates = const_cast<Aggregate*>(aggregates_);
+        uint64_t* dropped = const_cast<uint64_t*>(evicted_);
+        for (size_t i = 0; i < users.size(); ++i) {
+            const auto& vect = predictions.at(users[i]);
+            aggregates[i] = Aggregate{};
+            aggregates[i].Add(vect.data(), vect.data() + vect.size());
+            header->Total.Merge(aggregates[i]);
 
-    svr.Post("/admin/get", [&](const httplib::Request& req, httplib::Response& res) {
-        server.GetWaiters(req, res);
-    });
+            auto it = evicted.find(users[i]);
+            dropped[i] = it == evicted.end() ? 0 : it->second;
+        }
+    }
 
-    svr.Post("/admin/stat", [&](const httplib::Request& req, httplib::Response& res) {
-        server.GetStat(req, res);
-    });
+    static std::shared_ptr<const Segment> Map(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return nullptr;
+        }
 
-    svr.listen("0.0.0.0", 8080);
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+            ::close(fd);
+            return nullptr;
+        }
+
+        void* map = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED) {
+            return nullptr;
+        }
+
+        std::shared_ptr<Segment> segment(new Segment);
+        segment->map_ = map;
+        segment->data_ = static_cast<const char*>(map);
+        segment->size_ = st.st_size;
+
+        const Header* header = segment->header_ = reinterpret_cast<const Header*>(segment->data_);
+        bool evicted = header->Magic == kMagicEvicted;
+        if ((header->Magic != kMagic && !evicted) || header->Users > segment->size_ / sizeof(size_t) ||
+                header->Words > segment->size_ / sizeof(uint32_t) ||
+                Layout(header->Users, header->Words, evicted) != segment->size_) {
+            return nullptr;
+        }
+        segment->Bind();
+        if (!segment->Validate()) {
+            return nullptr;
+        }
+        return segment;
+    }
+
+    Segment(const Segment&) = delete;
+    Segment& operator=(const Segment&) = delete;
+
+    ~Segment() {
+        if (map_) {
+            ::munmap(map_, size_);
+        }
+    }
+
+    bool Save(const std::string& path) const {
+        std::string tmp = path + ".tmp";
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write(data_, size_);
+        out.close();
+        if (!out) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return std::rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    size_t GetId() const {
+        return header_->Id;
+    }
+
+    Clock::time_point GetStart() const {
+        return Clock::from_time_t(header_->Start);
+    }
+
+    Clock::time_point GetStop() const {
+        return Clock::from_time_t(header_->Stop);
+    }
+
+    size_t GetBytes() const {
+        return size_;
+    }
+
+    bool IsMapped() const {
+        return map_ != nullptr;
+    }
+
+    size_t GetUserCount() const {
+        return header_->Users;
+    }
+
+    size_t GetUser(size_t index) const {
+        return users_[index];
+    }
+
+    size_t Find(size_t user) const {
+        return std::lower_bound(users_, users_ + GetUserCount(), user) - users_;
+    }
+
+    size_t GetValueCount() const {
+        return header_->Values;
+    }
+
+    template <typename F>
+    void ForEachBlock(size_t index, F&& f) const {
+        BlockCodec::Decode(words_ + offsets_[index], aggregates_[index].Count, std::forward<F>(f));
+    }
+
+    const Aggregate& GetAggregate(size_t index) const {
+        return aggregates_[index];
+    }
+
+    // Predictions dropped by the evict quota policy; files written before it report none.
+    size_t GetEvicted(size_t index) const {
+        return evicted_ ? evicted_[index] : 0;
+    }
+
+    size_t GetEvicted() const {
+        size_t total = 0;
+        for (size_t i = 0; evicted_ && i < GetUserCount(); ++i) {
+            total += evicted_[i];
+        }
+        return total;
+    }
+
+    const Aggregate& GetAggregate() const {
+        return header_->Total;
+    }
+
+    void GetPredictions(size_t index, std::string* out) const {
+        out->reserve(out->size() + aggregates_[index].Count * NFormat::kMaxPredictionChars);
+        ForEachBlock(index, [&](const int* begin, const int* end) {
+            NFormat::AppendPredictions(begin, end, out);
+        });
+    }
+
+private:
+
+    static constexpr uint64_t kMagic = 0x3247455343455250;
+    static constexpr uint64_t kMagicEvicted = 0x3347455343455250;
+
+    struct Header {
+        uint64_t Magic;
+        uint64_t Id;
+        int64_t Start;
+        int64_t Stop;
+        uint64_t Users;
+        uint64_t Values;
+        uint64_t Words;
+        Aggregate Total;
+    };
+
+    Segment() = default;
+
+    static size_t Layout(size_t users, size_t words, bool evicted) {
+        return sizeof(Header) + users * sizeof(size_t) + (users + 1) * sizeof(size_t) +
+            users * sizeof(Aggregate) + (evicted ? users * sizeof(uint64_t) : 0) + words * sizeof(uint32_t);
+    }
+
+    // Every offset, count and block header read from the file has to stay inside the mapping.
+    bool Validate() const {
+        size_t users = header_->Users;
+        if (offsets_[0] != 0 || offsets_[users] != header_->Words) {
+            return false;
+        }
+
+        size_t values = 0;
+        for (size_t i = 0; i < users; ++i) {
+            if ((i && users_[i - 1] >= users_[i]) || offsets_[i] > offsets_[i + 1] ||
+                    !BlockCodec::Check(words_ + offsets_[i], offsets_[i + 1] - offsets_[i], aggregates_[i].Count)) {
+                return false;
+            }
+            values += aggregates_[i].Count;
+        }
+        return values == header_->Values;
+    }
+
+    void Bind() {
+        header_ = reinterpret_cast<const Header*>(data_);
+        const char* it = data_ + sizeof(Header);
+        users_ = reinterpret_cast<const size_t*>(it);
+        it += header_->Users * sizeof(size_t);
+        offsets_ = reinterpret_cast<const size_t*>(it);
+        it += (header_->Users + 1) * sizeof(size_t);
+        aggregates_ = reinterpret_cast<const Aggregate*>(it);
+        it += header_->Users * sizeof(Aggregate);
+        if (header_->Magic == kMagicEvicted) {
+            evicted_ = reinterpret_cast<const uint64_t*>(it);
+            it += header_->Users * sizeof(uint64_t);
+        }
+        words_ = reinterpret_cast<const uint32_t*>(it);
+    }
+
+    std::unique_ptr<uint64_t[]> buffer_;
+    void* map_ = nullptr;
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+
+    const Header* header_ = nullptr;
+    const size_t* users_ = nullptr;
+    const size_t* offsets_ = nullptr;
+    const Aggregate* aggregates_ = nullptr;
+    const uint64_t* evicted_ = nullptr;
+    const uint32_t* words_ = nullptr;
+};
+
+class SegmentCatalog {
+public:
+
+    SegmentCatalog(std::string dir, size_t budget)
+        : dir_(std::move(dir))
+        , budget_(budget)
+    {
+        std::error_code error;
+        std::filesystem::create_directories(dir_, error);
+        for (const auto& file : std::filesystem::directory_iterator(dir_, error)) {
+            if (file.path().extension() != ".seg") {
+                continue;
+            }
+
+            auto segment = Segment::Map(file.path().string());
+            if (!segment) {
+                continue;
+            }
+
+            Entry& entry = segments_[segment->GetId()];
+            entry.Path = file.path().string();
+            entry.Bytes = segment->GetBytes();
+        }
+    }
+
+    size_t GetNextId() const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return segments_.empty() ? 0 : segments_.rbegin()->first + 1;
+    }
+
+    // The segment is served from memory right away and stays resident until Persist has
+    // written it, which callers do after releasing their own locks.
+    void Add(std::shared_ptr<const Segment> segment) {
+        size_t id = segment->GetId();
+
+        std::lock_guard<std::mutex> lock(mtx_);
+        Entry& entry = segments_[id];
+        entry.Bytes = segment->GetBytes();
+        Touch(id, entry, std::move(segment));
+    }
+
+    void Persist(const Segment& segment) {
+        std::string path = dir_ + "/" + std::to_string(segment.GetId()) + ".seg";
+        if (!segment.Save(path)) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mtx_);
+        segments_[segment.GetId()].Path = std::move(path);
+        Trim();
+    }
+
+    // Cold segments are mapped and validated without mtx_, so reading one from disk does not
+    // stall every other history query.
+    std::vector<std::shared_ptr<const Segment>> Range(size_t from, size_t to) {
+        std::vector<std::pair<size_t, std::shared_ptr<const Segment>>> found;
+        std::vector<std::pair<size_t, std::string>> cold;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            for (auto it = segments_.lower_bound(from); it != segments_.end() && it->first <= to; ++it) {
+                if (it->second.Resident) {
+                    found.emplace_back(it->first, it->second.Resident);
+                } else {
+                    cold.emplace_back(it->first, it->second.Path);
+                }
+            }
+        }
+
+        for (const auto& [id, path] : cold) {
+            if (auto segment = Segment::Map(path)) {
+                found.emplace_back(id, std::move(segment));
+            }
+        }
+        std::sort(found.begin(), found.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.first < rhs.first;
+        });
+
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::vector<std::shared_ptr<const Segment>> result;
+        for (auto& [id, segment] : found) {
+            Entry& entry = segments_[id];
+            // Another query may have mapped the same segment meanwhile; the resident copy wins.
+            Touch(id, entry, entry.Resident ? entry.Resident : segment);
+            result.push_back(std::move(segment));
+        }
+        return result;
+    }
+
+    size_t GetResidentBytes() const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return resident_;
+    }
+
+    size_t GetStoredBytes() const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        size_t bytes = 0;
+        for (const auto& [id, entry] : segments_) {
+            bytes += entry.Bytes;
+        }
+        return bytes;
+    }
+
+    size_t GetSegmentCount() const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return segments_.size();
+    }
+
+    size_t GetBudget() const {
+        return budget_;
+    }
+
+private:
+
+    struct Entry {
+        std::string Path;
+        size_t Bytes = 0;
+        std::shared_ptr<const Segment> Resident;
+        std::list<size_t>::iterator Lru;
+    };
+
+    void Touch(size_t id, Entry& entry, std::shared_ptr<const Segment> segment) {
+        if (entry.Resident) {
+            lru_.erase(entry.Lru);
+        } else {
+            resident_ += entry.Bytes;
+        }
+        entry.Resident = std::move(segment);
+        lru_.push_front(id);
+        entry.Lru = lru_.begin();
+        Trim();
+    }
+
+    void Trim() {
+        for (auto it = lru_.end(); resident_ > budget_ && it != lru_.begin();) {
+            --it;
+            Entry& victim = segments_[*it];
+            if (victim.Path.empty()) {
+                continue;
+            }
+            resident_ -= victim.Bytes;
+            victim.Resident.reset();
+            it = lru_.erase(it);
+        }
+    }
+
+    std::string dir_;
+    size_t budget_;
+
+    mutable std::mutex mtx_;
+    std::map<size_t, Entry> segments_;
+    std::list<size_t> lru_;
+    size_t resident_ = 0;
+};
+
+class Experiment {
+public:
+
+    using Predictions = std::unordered_map<size_t, std::vector<int>>;
+
+    static constexpr size_t kNodeBytes = sizeof(void*) + sizeof(Predictions::value_type);
+    static constexpr size_t kEvictedNodeBytes = sizeof(void*) + sizeof(std::unordered_map<size_t, size_t>::value_type);
+    static constexpr size_t kMinCapacity = 16;
+
+    // Raw copy of the live predictions: cheap to take under the lock, encoded after it.
+    struct Snapshot {
+        size_t Id;
+        Segment::Clock::time_point Start;
+        Segment::Clock::time_point Stop;
+        Predictions Values;
+        std::unordered_map<size_t, size_t> Evicted;
+
+        std::shared_ptr<const Segment> Encode() const {
+            return std::make_shared<const Segment>(Id, Start, Stop, Values, Evicted);
+        }
+    };
+
+    void RegisterUser(size_t id) {
+        predictions_[id] = {};
+    }
+
+    bool IsRegistered(size_t id) {
+        return predictions_.find(id) != predictions_.end();
+    }
+
+    bool AddPrediction(size_t id, int num) {
+        auto it = predictions_.find(id);
+        if (it->second.size() == it->second.capacity() && !Grow(it)) {
+            ++rejected_;
+            return false;
+        }
+        it->second.push_back(num);
+        ++version_;
+        return true;
+    }
+
+    template <typename String>
+    void GetPredictions(size_t id, size_t since, String* out) {
+        const auto& vect = predictions_[id];
+        size_t from = std::min(since - std::min(since, GetEvicted(id)), vect.size());
+        NFormat::AppendPredictions(vect.data() + from, vect.data() + vect.size(), out);
+    }
+
+    size_t GetVersion(size_t id) {
+        return GetEvicted(id) + predictions_[id].size();
+    }
+
+    size_t GetEvicted(size_t id) const {
+        auto it = evicted_.find(id);
+        return it == evicted_.end() ? 0 : it->second;
+    }
+
+    // Bytes requested from the allocator for prediction values; this is what the quotas limit.
+    size_t GetBytes() const {
+        return bytes_;
+    }
+
+    size_t GetOverheadBytes() const {
+        return predictions_.size() * kNodeBytes + evicted_.size() * kEvictedNodeBytes
+            + (predictions_.bucket_count() + evicted_.bucket_count()) * sizeof(void*);
+    }
+
+    size_t GetPredictionCount() const {
+        return version_ - evicted_count_;
+    }
+
+    size_t GetEvictedCount() const {
+        return evicted_count_;
+    }
+
+    size_t GetRejectedCount() const {
+        return rejected_;
+    }
+
+    std::vector<std::pair<size_t, size_t>> GetLargest(size_t count) const {
+        std::vector<std::pair<size_t, size_t>> result;
+        result.reserve(predictions_.size());
+        for (const auto& [id, vect] : predictions_) {
+            result.emplace_back(vect.capacity() * sizeof(int), id);
+        }
+        count = std::min(count, result.size());
+        std::partial_sort(result.begin(), result.begin() + count, result.end(), std::greater<>{});
+        result.resize(count);
+        return result;
+    }
+
+    size_t GetVersion() const {
+        return version_;
+    }
+
+    size_t GetId() const {
+        return id_;
+    }
+
+    std::shared_ptr<const Segment> Flush() const {
+        return std::make_shared<const Segment>(id_, start_, Segment::Clock::now(), predictions_, evicted_);
+    }
+
+    Snapshot TakeSnapshot() const {
+        return {id_, start_, Segment::Clock::now(), predictions_, evicted_};
+    }
+
+    static bool IsActive() {
+        return NExperiment::self_ != nullptr;
+    }
+
+    static void Init() {
+        auto experiment = new Experiment{};
+        experiment->id_ = NExperiment::next_id_++;
+        experiment->start_ = Segment::Clock::now();
+        NExperiment::self_ = reinterpret_cast<char*>(experiment);
+    }
+
+    static void Destoy() {
+        delete Get();
+        NExperiment::self_ = nullptr;
+    }
+
+    static Experiment* Get() {
+        return reinterpret_cast<Experiment*>(NExperiment::self_);
+    }
+
+private:
+
+    // Grows a full vector within the quotas, evicting the oldest predictions when allowed.
+    bool Grow(Predictions::iterator it) {
+        auto& vect = it->second;
+        for (;;) {
+            size_t want = std::max(vect.capacity() * 2, kMinCapacity);
+            if (NExperiment::user_quota_) {
+                want = std::min(want, NExperiment::user_quota_ / sizeof(int));
+            }
+            if (NExperiment::experiment_quota_) {
+                size_t free = NExperiment::experiment_quota_ - std::min(bytes_, NExperiment::experiment_quota_);
+                want = std::min(want, vect.capacity() + free / sizeof(int));
+            }
+            if (want > vect.size()) {
+                bytes_ += (want - vect.capacity()) * sizeof(int);
+                vect.reserve(want);
+                return true;
+            }
+            if (!NExperiment::evict_) {
+                return false;
+            }
+
+            bool at_user_quota = NExperiment::user_quota_ && vect.size() >= NExperiment::user_quota_ / sizeof(int);
+            auto victim = at_user_quota ? it : Largest();
+            if (victim->second.empty()) {
+                return false;
+            }
+            Evict(victim, victim != it);
+        }
+    }
+
+    void Evict(Predictions::iterator it, bool shrink) {
+        auto& vect = it->second;
+        size_t count = std::max<size_t>(vect.size() / 4, 1);
+        vect.erase(vect.begin(), vect.begin() + count);
+        evicted_[it->first] += count;
+        evicted_count_ += count;
+        if (shrink) {
+            bytes_ -= (vect.capacity() - vect.size()) * sizeof(int);
+            std::vector<int>(vect.begin(), vect.end()).swap(vect);
+        }
+    }
+
+    Predictions::iterator Largest() {
+        auto largest = predictions_.begin();
+        for (auto it = predictions_.begin(); it != predictions_.end(); ++it) {
+            if (it->second.capacity() > largest->second.capacity()) {
+                largest = it;
+            }
+        }
+        return largest;
+    }
+
+    Predictions predictions_;
+    std::unordered_map<size_t, size_t> evicted_;
+    size_t version_ = 0;
+    size_t bytes_ = 0;
+    size_t evicted_count_ = 0;
+    size_t rejected_ = 0;
+    size_t id_ = 0;
+    Segment::Clock::time_point start_;
+};
+
+class ComputePool {
+public:
+
+    ComputePool(size_t threads, size_t max_parallelism)
+        : pool_(threads)
+        , max_parallelism_(std::max<size_t>(max_parallelism, 1))
+    {
+    }
+
+    ~ComputePool() {
+        pool_.shutdown();
+    }
+
+    size_t GetWorkers(size_t items) const {
+        return std::max<size_t>(std::min(items, max_parallelism_), 1);
+    }
+
+    template <typename F>
+    void Run(size_t items, F&& f) {
+        size_t workers = GetWorkers(items);
+        std::atomic<size_t> next{0};
+
+        std::mutex mtx;
+        std::condition_variable cv;
+        size_t done = 0;
+
+        auto work = [&](size_t worker) {
+            for (size_t item; (item = next.fetch_add(1)) < items;) {
+                f(item, worker);
+            }
+
+            std::lock_guard<std::mutex> lock(mtx);
+            ++done;
+            cv.notify_one();
+        };
+
+        for (size_t worker = 1; worker < workers; ++worker) {
+            if (!pool_.enqueue([&work, worker] { work(worker); })) {
+                work(worker);
+            }
+        }
+        work(0);
+
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&] { return done == workers; });
+    }
+
+private:
+    httplib::ThreadPool pool_;
+    size_t max_parallelism_;
+};
+
+class PredictionStream {
+public:
+
+    struct Event {
+        size_t Seq;
+        size_t Id;
+        int Pred;
+    };
+
+    enum class ReadStatus {
+        Ok,
+        Empty,
+        Overrun
+    };
+
+    static constexpr size_t kCapacity = 1 << 16;
+
+    PredictionStream()
+        : slots_(new Slot[kCapacity])
+    {
+    }
+
+    void Publish(size_t id, int pred) {
+        size_t seq = head_.fetch_add(1, std::memory_order_relaxed);
+        Slot& slot = slots_[seq % kCapacity];
+
+        slot.Seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.Id.store(id, std::memory_order_relaxed);
+        slot.Pred.store(pred, std::memory_order_relaxed);
+        slot.Seq.store(seq + 1, std::memory_order_release);
+
+        // Pairs with the fence in Wait: either the waiter sees this slot or we see the waiter.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(wait_mtx_);
+            cv_.notify_all();
+        }
+    }
+
+    ReadStatus Read(size_t seq, Event* event) const {
+        size_t head = head_.load(std::memory_order_acquire);
+        if (seq >= head) {
+            return ReadStatus::Empty;
+        }
+        if (head - seq > kCapacity) {
+            return ReadStatus::Overrun;
+        }
+
+        const Slot& slot = slots_[seq % kCapacity];
+        size_t before = slot.Seq.load(std::memory_order_acquire);
+        if (before < seq + 1) {
+            return ReadStatus::Empty;
+        }
+        if (before > seq + 1) {
+            return ReadStatus::Overrun;
+        }
+
+        event->Seq = seq;
+        event->Id = slot.Id.load(std::memory_order_relaxed);
+        event->Pred = slot.Pred.load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.Seq.load(std::memory_order_relaxed) != before) {
+            return ReadStatus::Overrun;
+        }
+        return ReadStatus::Ok;
+    }
+
+    void Wait(size_t seq, std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(wait_mtx_);
+        waiters_.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cv_.wait_for(lock, timeout, [&] {
+            return slots_[seq % kCapacity].Seq.load(std::memory_order_acquire) > seq;
+        });
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    size_t Head() const {
+        return head_.load(std::memory_order_acquire);
+    }
+
+    size_t Oldest() const {
+        size_t head = Head();
+        return head > kCapacity ? head - kCapacity : 0;
+    }
+
+    static constexpr size_t GetBytes() {
+        return kCapacity * sizeof(Slot);
+    }
+
+private:
+
+    struct Slot {
+        std::atomic<size_t> Seq{0};
+        std::atomic<size_t> Id{0};
+        std::atomic<int> Pred{0};
+    };
+
+    std::unique_ptr<Slot[]> slots_;
+    std::atomic<size_t> head_{0};
+
+    std::mutex wait_mtx_;
+    std::condition_variable cv_;
+    std::atomic<size_t> waiters_{0};
+};
+
+namespace NHttp {
+    constexpr size_t kCompressThreshold = 1024;
+    constexpr size_t kCompressChunk = CPPHTTPLIB_COMPRESSION_BUFSIZ;
+
+    inline bool AcceptsGzip(const httplib::Request& req) {
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+        return req.get_header_value("Accept-Encoding").find("gzip") != std::string::npos;
+#else
+        (void)req;
+        return false;
+#endif
+    }
+
+    inline void SendJson(const httplib::Request& req, httplib::Response& res, std::shared_ptr<const std::string> body) {
+        if (body->size() >= kCompressThreshold && AcceptsGzip(req)) {
+            res.set_chunked_content_provider("application/json", [body](size_t offset, httplib::DataSink& sink) {
+                size_t length = std::min(kCompressChunk, body->size() - offset);
+                if (!sink.write(body->data() + offset, length)) {
+                    return false;
+                }
+                if (offset + length == body->size()) {
+                    sink.done();
+                }
+                return true;
+            });
+            return;
+        }
+
+        size_t size = body->size();
+        res.set_content_provider(size, "application/json", [body](size_t offset, size_t length, httplib::DataSink& sink) {
+            return sink.write(body->data() + offset, length);
+        });
+    }
+
+    inline void SendJson(const httplib::Request& req, httplib::Response& res, std::string body) {
+        SendJson(req, res, std::make_shared<const std::string>(std::move(body)));
+    }
+
+    // Copies a body built in the request arena; a pooled response keeps its buffer between requests.
+    inline void SendJson(const httplib::Request& req, httplib::Response& res, std::string_view body) {
+        if (body.size() >= kCompressThreshold && AcceptsGzip(req)) {
+            SendJson(req, res, std::string(body));
+            return;
+        }
+        res.set_content(body.data(), body.size(), "application/json");
+    }
+
+    // Per-request scratch memory: the listener's arena while it serves a request on its fast path,
+    // the heap otherwise.
+    inline thread_local std::pmr::memory_resource* arena_ = nullptr;
+
+    inline std::pmr::memory_resource* GetArena() {
+        return arena_ ? arena_ : std::pmr::get_default_resource();
+    }
+
+    // Watch streams a worker pool lets run at once. A watcher holds its worker for the whole
+    // stream, so each listener caps them against its own pool.
+    struct WatchSlots {
+        size_t Limit = 0;
+        std::atomic<size_t> Used{0};
+    };
+
+    // The slots of the pool serving the current request; null means no cap.
+    inline thread_local WatchSlots* watch_slots_ = nullptr;
+
+    constexpr std::string_view kUnixPrefix = "unix:";
+
+    inline bool IsUnix(std::string_view address) {
+        return address.substr(0, kUnixPrefix.size()) == kUnixPrefix;
+    }
+}
+
+class ResponseCache {
+public:
+
+    struct Entry {
+        uint64_t Generation;
+        std::string ETag;
+        std::string Body;
+    };
+
+    static constexpr size_t kMaxEntries = 256;
+
+    uint64_t GetGeneration() const {
+        return generation_.load(std::memory_order_acquire);
+    }
+
+    void Bump() {
+        generation_.fetch_add(1, std::memory_order_acq_rel);
+    }
+
+    std::shared_ptr<const Entry> Find(const std::string& key) const {
+        std::shared_lock<std::shared_mutex> lock(mtx_);
+        auto it = entries_.find(key);
+        if (it == entries_.end() || it->second->Generation != GetGeneration()) {
+            return nullptr;
+        }
+        return it->second;
+    }
+
+    std::shared_ptr<const Entry> Store(std::string key, uint64_t generation, std::string etag, std::string body) {
+        auto entry = std::make_shared<const Entry>(Entry{generation, std::move(etag), std::move(body)});
+        if (generation != GetGeneration()) {
+            return entry;
+        }
+
+        std::unique_lock<std::shared_mutex> lock(mtx_);
+        if (entries_.size() >= kMaxEntries) {
+            for (auto it = entries_.begin(); it != entries_.end();) {
+                it = it->second->Generation != generation ? entries_.erase(it) : std::next(it);
+            }
+            if (entries_.size() >= kMaxEntries) {
+                entries_.clear();
+            }
+        }
+        entries_[std::move(key)] = entry;
+        return entry;
+    }
+
+    static std::string MakeKey(const std::string& path, json request) {
+        request.erase("secret");
+        return path + request.dump();
+    }
+
+    static void Serve(const httplib::Request& req, httplib::Response& res, std::shared_ptr<const Entry> entry) {
+        if (!entry->ETag.empty()) {
+            res.set_header("ETag", entry->ETag);
+            if (req.get_header_value("If-None-Match") == entry->ETag) {
+                res.status = 304;
+                return;
+            }
+        }
+
+        res.status = 200;
+        NHttp::SendJson(req, res, std::shared_ptr<const std::string>(entry, &entry->Body));
+    }
+
+    size_t GetEntryCount() const {
+        std::shared_lock<std::shared_mutex> lock(mtx_);
+        return entries_.size();
+    }
+
+    size_t GetBytes() const {
+        std::shared_lock<std::shared_mutex> lock(mtx_);
+        size_t bytes = 0;
+        for (const auto& [key, entry] : entries_) {
+            bytes += key.capacity() + entry->ETag.capacity() + entry->Body.capacity() + sizeof(Entry);
+        }
+        return bytes;
+    }
+
+private:
+    std::atomic<uint64_t> generation_{0};
+
+    mutable std::shared_mutex mtx_;
+    std::unordered_map<std::string, std::shared_ptr<const Entry>> entries_;
+};
+
+// Token buckets in GCRA form: each bucket is one atomic "theoretical arrival time", a request
+// is admitted while that clock stays within one second of now and advances it by one interval.
+class RateLimiter {
+public:
+
+    static constexpr uint64_t kBurstNs = 1'000'000'000;
+    static constexpr size_t kChunkBits = 12;
+    static constexpr size_t kMaxChunks = 4096;
+
+    RateLimiter(uint64_t user_rate, uint64_t global_rate)
+        : user_interval_(user_rate ? kBurstNs / user_rate : 0)
+        , global_interval_(global_rate ? kBurstNs / global_rate : 0)
+    {}
+
+    ~RateLimiter() {
+        for (auto& chunk : chunks_) {
+            delete[] chunk.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Called under the users lock, so chunks are only ever published by one writer.
+    void Reserve(size_t id) {
+        size_t chunk = id >> kChunkBits;
+        if (chunk < kMaxChunks && !chunks_[chunk].load(std::memory_order_relaxed)) {
+            chunks_[chunk].store(new Bucket[size_t{1} << kChunkBits], std::memory_order_release);
+        }
+    }
+
+    bool AcquireGlobal() {
+        if (Take(global_, global_interval_)) {
+            return true;
+        }
+        throttled_global_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Hands back a global token taken by a request that was not recorded after all.
+    void ReleaseGlobal() {
+        if (global_interval_) {
+            global_.fetch_sub(global_interval_, std::memory_order_relaxed);
+        }
+    }
+
+    // Ids without a bucket of their own (never registered, or past the last chunk) share one.
+    bool AcquireUser(size_t id) {
+        Bucket* bucket = Find(id);
+        if (!bucket) {
+            bucket = &overflow_;
+        }
+        if (Take(bucket->Clock, user_interval_)) {
+            return true;
+        }
+        bucket->Throttled.fetch_add(1, std::memory_order_relaxed);
+        throttled_user_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    size_t GetBytes() const {
+        size_t bytes = 0;
+        for (const auto& chunk : chunks_) {
+            if (chunk.load(std::memory_order_acquire)) {
+                bytes += sizeof(Bucket) << kChunkBits;
+            }
+        }
+        return bytes;
+    }
+
+    json GetStat(size_t users) const {
+        json result;
+        result["user_rate"] = user_interval_ ? kBurstNs / user_interval_ : 0;
+        result["global_rate"] = global_interval_ ? kBurstNs / global_interval_ : 0;
+        result["throttled_global"] = throttled_global_.load(std::memory_order_relaxed);
+        result["throttled_user"] = throttled_user_.load(std::memory_order_relaxed);
+        result["throttled_overflow"] = overflow_.Throttled.load(std::memory_order_relaxed);
+        result["users"] = json::object();
+        for (size_t id = 0; id < users; ++id) {
+            Bucket* bucket = Find(id);
+            uint64_t throttled = bucket ? bucket->Throttled.load(std::memory_order_relaxed) : 0;
+            if (throttled) {
+                result["users"][std::to_string(id)] = throttled;
+            }
+        }
+        return result;
+    }
+
+private:
+    struct Bucket {
+        std::atomic<uint64_t> Clock{0};
+        std::atomic<uint64_t> Throttled{0};
+    };
+
+    Bucket* Find(size_t id) const {
+        size_t chunk = id >> kChunkBits;
+        if (chunk >= kMaxChunks) {
+            return nullptr;
+        }
+        Bucket* buckets = chunks_[chunk].load(std::memory_order_acquire);
+        return buckets ? &buckets[id & ((size_t{1} << kChunkBits) - 1)] : nullptr;
+    }
+
+    static bool Take(std::atomic<uint64_t>& clock, uint64_t interval) {
+        if (!interval) {
+            return true;
+        }
+        uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        uint64_t tat = clock.load(std::memory_order_relaxed);
+        for (;;) {
+            uint64_t next = std::max(tat, now) + interval;
+            if (next > now + kBurstNs) {
+                return false;
+            }
+            if (clock.compare_exchange_weak(tat, next, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+    }
+
+    const uint64_t user_interval_;
+    const uint64_t global_interval_;
+    std::atomic<uint64_t> global_{0};
+    std::atomic<uint64_t> throttled_global_{0};
+    std::atomic<uint64_t> throttled_user_{0};
+    std::atomic<Bucket*> chunks_[kMaxChunks] = {};
+    Bucket overflow_;
+};
+
+class Notifier {
+public:
+
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t kMaxInFlight = 1024;
+    static constexpr std::chrono::seconds kTimeout{5};
+    static constexpr size_t kMaxAttempts = 8;
+    static constexpr std::chrono::milliseconds kBaseDelay{200};
+    static constexpr std::chrono::milliseconds kMaxDelay{30000};
+    static constexpr size_t kBreakerThreshold = 5;
+    static constexpr std::chrono::seconds kBreakerCooldown{30};
+    static constexpr std::chrono::milliseconds kCoalesceWindow{5};
+    static constexpr size_t kMaxBatch = 64;
+    static constexpr std::chrono::milliseconds kBusyDelay{10};
+
+    explicit Notifier(const std::string& dir)
+        : journal_path_(dir + "/notify.journal")
+        , dead_path_(dir + "/notify.dead")
+        , epoll_fd_(::epoll_create1(EPOLL_CLOEXEC))
+        , wake_fd_(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+    {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = wake_fd_;
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event);
+
+        Recover();
+        thread_ = std::thread([this] { Loop(); });
+        resolver_ = std::thread([this] { ResolveLoop(); });
+        writer_ = std::thread([this] { WriteLoop(); });
+    }
+
+    Notifier(const Notifier&) = delete;
+    Notifier& operator=(const Notifier&) = delete;
+
+    ~Notifier() {
+        stop_ = true;
+        Wake();
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+        }
+        resolve_cv_.notify_all();
+        thread_.join();
+        resolver_.join();
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            writer_stop_ = true;
+        }
+        write_cv_.notify_all();
+        writer_.join();
+        for (auto& [sock, call] : calls_) {
+            ::close(sock);
+        }
+        for (int fd : {journal_fd_, dead_fd_}) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+        ::close(wake_fd_);
+        ::close(epoll_fd_);
+    }
+
+    // Queues a POST and returns at once; the request is driven by the notifier's event loop,
+    // so a slow or dead receiver costs a socket instead of a worker thread.
+    void Post(std::string address, std::string path, std::string body) {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            submitted_.push_back({std::move(address), std::move(path), std::move(body)});
+        }
+        Wake();
+    }
+
+private:
+
+    struct Message {
+        std::string Address;
+        std::string Path;
+        std::string Body;
+        std::string ContentType = "text/plain";
+        size_t Attempts = 0;
+        uint64_t JournalId = 0;
+        Clock::time_point BusySince{};
+    };
+
+    enum class Log {
+        Journal,
+        Dead,
+    };
+
+    struct Record {
+        Log Target;
+        std::string Line;
+    };
+
+    // Messages for one destination that arrive within kCoalesceWindow of each other
+    // leave as a single request whose body is a JSON array of the individual bodies.
+    struct Batch {
+        Clock::time_point Due;
+        std::vector<std::string> Bodies;
+    };
+
+    struct Endpoint {
+        sockaddr_storage Addr{};
+        socklen_t Length = 0;
+        std::string Host;
+    };
+
+    struct Call {
+        Message Payload;
+        std::string Out;
+        size_t Sent = 0;
+        std::string In;
+        bool Connected = false;
+        Clock::time_point Deadline;
+    };
+
+    // Consecutive failures drive both the retry delay and the breaker: once it opens,
+    // nothing is sent to the destination until the cooldown ends and a single probe succeeds.
+    struct Destination {
+        size_t Failures = 0;
+        Clock::time_point OpenUntil;
+        bool Probing = false;
+    };
+
+    void Wake() {
+        uint64_t one = 1;
+        [[maybe_unused]] auto _ = ::write(wake_fd_, &one, sizeof(one));
+    }
+
+    void Loop() {
+        std::array<epoll_event, 256> events;
+        while (!stop_) {
+            auto next = Clock::time_point::max();
+            for (const auto& [sock, call] : calls_) {
+                next = std::min(next, call.Deadline);
+            }
+            if (!retries_.empty()) {
+                next = std::min(next, retries_.begin()->first);
+            }
+            for (const auto& [key, batch] : batches_) {
+                next = std::min(next, batch.Due);
+            }
+
+            int timeout = -1;
+            if (next != Clock::time_point::max()) {
+                timeout = std::max<int64_t>(std::chrono::ceil<std::chrono::milliseconds>(next - Clock::now()).count(), 0);
+            }
+
+            int ready = ::epoll_wait(epoll_fd_, events.data(), events.size(), timeout);
+            for (int i = 0; i < ready; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == wake_fd_) {
+                    uint64_t value;
+                    [[maybe_unused]] auto _ = ::read(wake_fd_, &value, sizeof(value));
+                    continue;
+                }
+
+                auto it = calls_.find(fd);
+                if (it != calls_.end() && !Resume(fd, it->second)) {
+                    Finish(fd);
+                }
+            }
+
+            auto now = Clock::now();
+            for (auto it = calls_.begin(); it != calls_.end();) {
+                auto next = std::next(it);
+                if (it->second.Deadline <= now) {
+                    Finish(it->first);
+                }
+                it = next;
+            }
+
+            for (auto it = retries_.begin(); it != retries_.end() && it->first <= now; it = retries_.erase(it)) {
+                backlog_.push_back(std::move(it->second));
+            }
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                incoming_.swap(submitted_);
+                lookups_.swap(resolved_);
+            }
+            for (auto& [address, endpoint] : lookups_) {
+                bool found = Remember(address, std::move(endpoint)) != nullptr;
+                for (auto& message : waiting_[address]) {
+                    if (found) {
+                        backlog_.push_back(std::move(message));
+                    } else {
+                        Complete(std::move(message), false);
+                    }
+                }
+                waiting_.erase(address);
+            }
+            lookups_.clear();
+            for (auto& message : incoming_) {
+                Batch& batch = batches_[{std::move(message.Address), std::move(message.Path)}];
+                if (batch.Bodies.empty()) {
+                    batch.Due = now + kCoalesceWindow;
+                }
+                batch.Bodies.push_back(std::move(message.Body));
+            }
+            incoming_.clear();
+
+            for (auto it = batches_.begin(); it != batches_.end();) {
+                if (it->second.Due > now && it->second.Bodies.size() < kMaxBatch) {
+                    ++it;
+                    continue;
+                }
+
+                Message message{it->first.first, it->first.second, {}};
+                if (it->second.Bodies.size() == 1) {
+                    message.Body = std::move(it->second.Bodies.front());
+                } else {
+                    message.Body = json(it->second.Bodies).dump();
+                    message.ContentType = "application/json";
+                }
+                backlog_.push_back(std::move(message));
+                it = batches_.erase(it);
+            }
+
+            while (!backlog_.empty() && calls_.size() < kMaxInFlight) {
+                Dispatch(std::move(backlog_.front()));
+                backlog_.pop_front();
+            }
+        }
+    }
+
+    void Dispatch(Message message) {
+        const Endpoint* endpoint = nullptr;
+        auto cached = endpoints_.find(message.Address);
+        if (cached != endpoints_.end()) {
+            endpoint = &cached->second;
+        } else if (NHttp::IsUnix(message.Address)) {
+            endpoint = Remember(message.Address, Lookup(message.Address));
+        } else {
+            Await(std::move(message));
+            return;
+        }
+
+        Destination& destination = destinations_[message.Address];
+        auto now = Clock::now();
+        if (destination.Failures >= kBreakerThreshold) {
+            if (now < destination.OpenUntil || destination.Probing) {
+                Defer(std::move(message), std::max(destination.OpenUntil, now + kBaseDelay));
+                return;
+            }
+            destination.Probing = true;
+        }
+
+        int sock = endpoint ? ::socket(endpoint->Addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0) : -1;
+        if (sock >= 0 && ::connect(sock, reinterpret_cast<const sockaddr*>(&endpoint->Addr), endpoint->Length) != 0 &&
+            errno != EINPROGRESS) {
+            // A unix listener with a full backlog answers EAGAIN instead of queuing the connect;
+            // the receiver is alive, so keep trying for as long as a TCP connect would wait.
+            bool busy = errno == EAGAIN;
+            ::close(sock);
+            if (busy && message.BusySince == Clock::time_point{}) {
+                message.BusySince = now;
+            }
+            if (busy && now - message.BusySince < kTimeout) {
+                destination.Probing = false;
+                retries_.emplace(now + kBusyDelay, std::move(message));
+                return;
+            }
+            sock = -1;
+        }
+        if (sock < 0) {
+            Complete(std::move(message), false);
+            return;
+        }
+
+        Call& call = calls_[sock];
+        call.Out = "POST " + message.Path + " HTTP/1.1\r\nHost: " + endpoint->Host +
+                   "\r\nConnection: close\r\nContent-Type: " + message.ContentType + "\r\nContent-Length: " +
+                   std::to_string(message.Body.size()) + "\r\n\r\n" + message.Body;
+        call.Payload = std::move(message);
+        call.Deadline = now + kTimeout;
+
+        epoll_event event{};
+        event.events = EPOLLOUT;
+        event.data.fd = sock;
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, sock, &event);
+    }
+
+    // Advances a call as far as the socket allows; false once it is over, either way.
+    bool Resume(int sock, Call& call) {
+        if (!call.Connected) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (::getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error) {
+                return false;
+            }
+            call.Connected = true;
+        }
+
+        if (call.Sent < call.Out.size()) {
+            ssize_t ret = ::send(sock, call.Out.data() + call.Sent, call.Out.size() - call.Sent, MSG_NOSIGNAL);
+            if (ret < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+
+            call.Sent += ret;
+            if (call.Sent == call.Out.size()) {
+                epoll_event event{};
+                event.events = EPOLLIN | EPOLLRDHUP;
+                event.data.fd = sock;
+                ::epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, sock, &event);
+            }
+            return true;
+        }
+
+        char buffer[4096];
+        for (;;) {
+            ssize_t ret = ::recv(sock, buffer, sizeof(buffer), 0);
+            if (ret <= 0) {
+                return ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            }
+            call.In.append(buffer, ret);
+        }
+    }
+
+    void Finish(int sock) {
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, sock, nullptr);
+        ::close(sock);
+
+        auto it = calls_.find(sock);
+        const std::string& in = it->second.In;
+        bool delivered = in.size() > 12 && in.compare(0, 5, "HTTP/") == 0 && in[in.find(' ') + 1] == '2';
+        Message message = std::move(it->second.Payload);
+        calls_.erase(it);
+        Complete(std::move(message), delivered);
+    }
+
+    void Complete(Message message, bool delivered) {
+        message.BusySince = {};
+        Destination& destination = destinations_[message.Address];
+        destination.Probing = false;
+        if (delivered) {
+            destination.Failures = 0;
+            Forget(message);
+            return;
+        }
+
+        auto now = Clock::now();
+        if (++destination.Failures >= kBreakerThreshold) {
+            destination.OpenUntil = now + kBreakerCooldown;
+        }
+        if (++message.Attempts >= kMaxAttempts) {
+            DeadLetter(message);
+            Forget(message);
+            return;
+        }
+
+        auto delay = kBaseDelay * (size_t{1} << std::min<size_t>(destination.Failures - 1, 16));
+        Defer(std::move(message), now + std::min<Clock::duration>(delay, kMaxDelay));
+    }
+
+    void Defer(Message message, Clock::time_point due) {
+        if (!message.JournalId) {
+            message.JournalId = ++journal_next_;
+            json record;
+            record["id"] = message.JournalId;
+            record["address"] = message.Address;
+            record["path"] = message.Path;
+            record["body"] = message.Body;
+            record["type"] = message.ContentType;
+            record["attempts"] = message.Attempts;
+            Journal(record);
+            ++journal_live_;
+        }
+        retries_.emplace(due, std::move(message));
+    }
+
+    void Forget(const Message& message) {
+        if (!message.JournalId) {
+            return;
+        }
+
+        if (--journal_live_ == 0) {
+            Enqueue({Log::Journal, ""});
+            return;
+        }
+        json record;
+        record["done"] = message.JournalId;
+        Journal(record);
+    }
+
+    void Journal(const json& record) {
+        Enqueue({Log::Journal, record.dump() + '\n'});
+    }
+
+    void DeadLetter(const Message& message) {
+        json record;
+        record["address"] = message.Address;
+        record["path"] = message.Path;
+        record["body"] = message.Body;
+        record["type"] = message.ContentType;
+        record["attempts"] = message.Attempts;
+        record["time"] = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        Enqueue({Log::Dead, record.dump() + '\n'});
+    }
+
+    void Enqueue(Record record) {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            records_.push_back(std::move(record));
+        }
+        write_cv_.notify_one();
+    }
+
+    // The event loop never touches the disk: journal and dead-letter records are appended here
+    // and each batch is fdatasync-ed before the next one is taken. A retry therefore survives
+    // a crash once the batch holding it has been synced, usually well within a millisecond.
+    void WriteLoop() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        for (;;) {
+            write_cv_.wait(lock, [this] { return writer_stop_ || !records_.empty(); });
+            if (records_.empty()) {
+                return;
+            }
+
+            std::vector<Record> batch;
+            batch.swap(records_);
+            lock.unlock();
+            Write(batch);
+            lock.lock();
+        }
+    }
+
+    // A journal record without a line truncates the journal: every retry in it is settled.
+    void Write(const std::vector<Record>& batch) {
+        bool synced[2] = {true, true};
+        for (const auto& record : batch) {
+            bool journal = record.Target == Log::Journal;
+            int& fd = journal ? journal_fd_ : dead_fd_;
+            if (fd < 0) {
+                fd = ::open((journal ? journal_path_ : dead_path_).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                if (fd < 0) {
+                    continue;
+                }
+            }
+
+            if (record.Line.empty()) {
+                [[maybe_unused]] auto _ = ::ftruncate(fd, 0);
+            }
+            for (size_t written = 0; written < record.Line.size();) {
+                ssize_t ret = ::write(fd, record.Line.data() + written, record.Line.size() - written);
+                if (ret < 0 && errno != EINTR) {
+                    break;
+                }
+                written += std::max<ssize_t>(ret, 0);
+            }
+            synced[journal] = false;
+        }
+
+        if (!synced[true]) {
+            ::fdatasync(journal_fd_);
+        }
+        if (!synced[false]) {
+            ::fdatasync(dead_fd_);
+        }
+    }
+
+    // Replays the journal left by a previous run: every retry without a matching "done"
+    // record is rewritten to a fresh journal and queued for immediate delivery.
+    void Recover() {
+        std::map<uint64_t, Message> pending;
+        std::ifstream in(journal_path_);
+        for (std::string line; std::getline(in, line);) {
+            json record = json::parse(line, nullptr, false);
+            if (!record.is_object()) {
+                continue;
+            }
+            if (record.contains("done")) {
+                pending.erase(record["done"].get<uint64_t>());
+            } else if (record.contains("id")) {
+                pending[record["id"]] = {record.value("address", ""), record.value("path", ""), record.value("body", ""),
+                                         record.value("type", "text/plain"), record.value("attempts", size_t{0})};
+            }
+        }
+        in.close();
+
+        // Runs before the threads start, so the fresh journal is written here directly; its
+        // descriptor stays open and keeps pointing at the journal after the rename.
+        std::string fresh = journal_path_ + ".tmp";
+        journal_fd_ = ::open(fresh.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        for (auto& [id, message] : pending) {
+            Defer(std::move(message), Clock::now());
+        }
+        Write(records_);
+        records_.clear();
+
+        std::error_code error;
+        std::filesystem::rename(fresh, journal_path_, error);
+    }
+
+    // getaddrinfo can block for seconds, so host names are looked up on the resolver thread;
+    // messages for an address wait in waiting_ until its lookup comes back through resolved_.
+    void Await(Message message) {
+        auto& waiting = waiting_[message.Address];
+        if (waiting.empty()) {
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                unresolved_.push_back(message.Address);
+            }
+            resolve_cv_.notify_one();
+        }
+        waiting.push_back(std::move(message));
+    }
+
+    void ResolveLoop() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        for (;;) {
+            resolve_cv_.wait(lock, [this] { return stop_ || !unresolved_.empty(); });
+            if (stop_) {
+                return;
+            }
+
+            std::string address = std::move(unresolved_.front());
+            unresolved_.pop_front();
+            lock.unlock();
+            auto endpoint = Lookup(address);
+            lock.lock();
+            resolved_.emplace_back(std::move(address), std::move(endpoint));
+            Wake();
+        }
+    }
+
+    // Failed lookups are not cached, so the next attempt resolves again.
+    const Endpoint* Remember(const std::string& address, std::optional<Endpoint> endpoint) {
+        if (!endpoint) {
+            return nullptr;
+        }
+        return &endpoints_.insert_or_assign(address, std::move(*endpoint)).first->second;
+    }
+
+    static std::optional<Endpoint> Lookup(const std::string& address) {
+        Endpoint endpoint;
+        if (NHttp::IsUnix(address)) {
+            std::string path = address.substr(NHttp::kUnixPrefix.size());
+            auto* addr = reinterpret_cast<sockaddr_un*>(&endpoint.Addr);
+            if (path.size() >= sizeof(addr->sun_path)) {
+                return std::nullopt;
+            }
+
+            addr->sun_family = AF_UNIX;
+            std::copy(path.begin(), path.end(), addr->sun_path);
+            endpoint.Length = sizeof(sockaddr_un);
+            endpoint.Host = "localhost";
+        } else {
+            std::string host = address;
+            size_t scheme = host.find("://");
+            if (scheme != std::string::npos) {
+                host.erase(0, scheme + 3);
+            }
+            endpoint.Host = host;
+
+            std::string port = "80";
+            size_t colon = host.rfind(':');
+            if (colon != std::string::npos) {
+                port = host.substr(colon + 1);
+                host.erase(colon);
+            }
+
+            addrinfo hints{};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo* result = nullptr;
+            if (::getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0) {
+                return std::nullopt;
+            }
+
+            std::memcpy(&endpoint.Addr, result->ai_addr, result->ai_addrlen);
+            endpoint.Length = result->ai_addrlen;
+            ::freeaddrinfo(result);
+        }
+        return endpoint;
+    }
+
+    std::string journal_path_;
+    std::string dead_path_;
+    uint64_t journal_next_ = 0;
+    size_t journal_live_ = 0;
+    int journal_fd_ = -1;
+    int dead_fd_ = -1;
+
+    int epoll_fd_;
+    int wake_fd_;
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+    std::thread resolver_;
+    std::thread writer_;
+
+    std::mutex mtx_;
+    std::condition_variable resolve_cv_;
+    std::condition_variable write_cv_;
+    std::vector<Record> records_;
+    bool writer_stop_ = false;
+    std::vector<Message> submitted_;
+    std::vector<Message> incoming_;
+    std::deque<std::string> unresolved_;
+    std::vector<std::pair<std::string, std::optional<Endpoint>>> resolved_;
+    std::vector<std::pair<std::string, std::optional<Endpoint>>> lookups_;
+    std::unordered_map<std::string, std::vector<Message>> waiting_;
+
+    std::map<std::pair<std::string, std::string>, Batch> batches_;
+    std::deque<Message> backlog_;
+    std::multimap<Clock::time_point, Message> retries_;
+    std::unordered_map<int, Call> calls_;
+    std::unordered_map<std::string, Endpoint> endpoints_;
+    std::unordered_map<std::string, Destination> destinations_;
+};
+
+class HttpServer {
+public:
+
+    struct User {
+        size_t Id;
+        std::string Address;
+    };
+
+    HttpServer(std::string history_dir, size_t history_budget, uint64_t user_rate, uint64_t global_rate)
+        : limiter_(user_rate, global_rate)
+        , catalog_(history_dir, history_budget)
+        , compute_(std::max(std::thread::hardware_concurrency(), 1u), kMaxQueryParallelism)
+        , notifier_(history_dir)
+    {
+        NExperiment::next_id_ = catalog_.GetNextId();
+    }
+
+    size_t Push(std::string address) {
+        std::lock_guard<std::mutex> lock(mtx_);
+
+        std::cout << address << '\n';
+
+        size_t id = users_.size();
+        users_.push_back({
+            .Id = id,
+            .Address = std::move(address)
+        });
+        limiter_.Reserve(id);
+        cache_.Bump();
+        return id;
+    }
+
+    void Start() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        Experiment::Init();
+        cache_.Bump();
+
+        for (auto& user : users_) {
+            Experiment::Get()->RegisterUser(user.Id);
+
+            notifier_.Post(user.Address, "/notify", "Experiment is started!");
+        }
+    }
+
+    std::shared_ptr<const Segment> Stop() {
+        auto segment = Experiment::Get()->Flush();
+        catalog_.Add(segment);
+        Experiment::Destoy();
+        cache_.Bump();
+        return segment;
+    }
+
+
+    void RegisterUser(const httplib::Request& req, httplib::Response& res) {
+        json request;
+        try { 
+            request = json::parse(req.body);
+        } catch (json::exception&) {
+            res.status = 400;
+            return;
+        }
+
+        size_t id = Push(request["host"]);
+
+        res.status = 200;
+        json response;
+        response["id"] = id;
+        NHttp::SendJson(req, res, response.dump());
+        
+    }
+
+    // Runs before the body is read, so a request over the global rate is never parsed.
+    bool AdmitPrediction(httplib::Response& res) {
+        if (limiter_.AcquireGlobal()) {
+            return true;
+        }
+        Throttle(res);
+        return false;
+    }
+
+    // Hands back the token taken by AdmitPrediction when the body never arrived.
+    void CancelPrediction() {
+        limiter_.ReleaseGlobal();
+    }
+
+    void RegisterPrediction(std::string_view body, httplib::Response& res) {
+        res.status = AddPrediction(body);
+        if (res.status != 200) {
+            limiter_.ReleaseGlobal();
+        }
+        if (res.status == 429) {
+            Throttle(res);
+        }
+    }
+
+    int AddPrediction(std::string_view body) {
+        NJson::FlatObject request;
+        int pred;
+        size_t id;
+        if (!request.Parse(body) || !request.Get("pred", &pred) || !request.Get("id", &id)) {
+            return 400;
+        }
+
+        if (!limiter_.AcquireUser(id)) {
+            return 429;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(exp_mtx_);
+            if (!Experiment::IsActive() || !Experiment::Get()->IsRegistered(id)) {
+                return 400;
+            }
+
+            if (!Experiment::Get()->AddPrediction(id, pred)) {
+                return 507;
+            }
+            cache_.Bump();
+        }
+
+        stream_.Publish(id, pred);
+        return 200;
+    }
+
+    void GetPredictions(const httplib::Request& req, httplib::Response& res) {
+        NJson::FlatObject request;
+        size_t id;
+        size_t requested = 0;
+        size_t from = 0;
+        if (!request.Parse(req.body) || !request.Get("id", &id)) {
+            res.status = 400;
+            return;
+        }
+        bool has_since = request.Get("since", &requested);
+        bool has_from = request.Get("experiment", &from);
+        if (has_since != request.Contains("since") || has_from != request.Contains("experiment")) {
+            res.status = 400;
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(exp_mtx_);
+        if (!Experiment::IsActive() || !Experiment::Get()->IsRegistered(id)) {
+            res.status = 400;
+            return;
+        }
+
+        auto experiment = Experiment::Get();
+        size_t version = experiment->GetVersion(id);
+        std::string etag = MakeETag(experiment->GetId(), version);
+        res.set_header("ETag", etag);
+        if (req.get_header_value("If-None-Match") == etag) {
+            res.status = 304;
+            return;
+        }
+
+        size_t since = 0;
+        if (has_since && (!has_from || from == experiment->GetId())) {
+            since = std::min(requested, version);
+        }
+        since = std::max(since, experiment->GetEvicted(id));
+
+        // The bytes json::dump gives for these keys; predictions are digits, '-' and spaces only.
+        res.status = 200;
+        std::pmr::string response(NHttp::GetArena());
+        response.reserve(96 + (version - since) * NFormat::kMaxPredictionChars);
+        response.append("{\"experiment\":");
+        NFormat::AppendNumber(experiment->GetId(), &response);
+        response.append(",\"predictions\":\"");
+        experiment->GetPredictions(id, since, &response);
+        response.append("\",\"since\":");
+        NFormat::AppendNumber(since, &response);
+        response.append(",\"version\":");
+        NFormat::AppendNumber(version, &response);
+        response.append("}");
+        NHttp::SendJson(req, res, std::string_view(response));
+    }
+
+    void StartExperiment(const httplib::Request& req, httplib::Response& res) {
+        json request;
+        try {
+            request = json::parse(req.body);
+        } catch (json::exception&) {
+            res.status = 400;
+            return;
+        }
+
+        size_t secret = request["secret"];
+        if (!checker_.CheckSecret(secret)) {
+            res.status = 400;
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(exp_mtx_);
+        if (Experiment::IsActive()) {
+            res.status = 400;
+            return;
+        }
+
+        Start();
+        res.status = 200;
+    }
+
+    void StopExperiment(const httplib::Request& req, httplib::Response& res) {
+        json request;
+        try {
+            request = json::parse(req.body);
+        } catch (json::exception&) {
+            res.status = 400;
+            return;
+        }
+
+        size_t secret = request["secret"];
+        if (!checker_.CheckSecret(secret)) {
+            res.status = 400;
+            return;
+        }
+
+        std::shared_ptr<const Segment> segment;
+        {
+            std::lock_guard<std::mutex> lock(exp_mtx_);
+            if (!Experiment::IsActive()) {
+                res.status = 400;
+                return;
+            }
+            segment = Stop();
+        }
+
+        catalog_.Persist(*segment);
+        res.status = 200;
+    }
+
+    void AnswerToUser(const httplib::Request& req, httplib::Response& res) {
+        json request;
+        try {
+            request = json::parse(req.body);
+        } catch (json::exception&) {
+            res.status = 400;
+            return;
+        }
+
+        size_t secret = request["secret"];
+        if (!checker_.CheckSecret(secret)) {
+            res.status = 400;
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(exp_mtx_);
+        if (!Experiment::IsActive()) {
+            res.status = 400;
+            return;
+        }
+
+        size_t id = request["id"];
+        std::string ans = request["answer"];
+
+        notifier_.Post(users_[id].Address, "/notify", std::move(ans));
+
+        res.status = 200;
+    }
+
+    void GetWaiters(const httplib::Request& req, httplib::Response& res) {
+        json request;
+        try {
+            request = json::parse(req.body);
+        } catch (json::exception&) {
+            res.status = 400;
+            return;
+        }
+
+        size_t secret = request["secret"];
+        if (!checker_.CheckSecret(secret)) {
+            res.status = 400;
+            return;
+        }
+
+        std::string key = ResponseCache::MakeKey(req.path, request);
+        if (auto cached = cache_.Find(key)) {
+            ResponseCache::Serve(req, res, std::move(cached));
+            return;
+        }
+        uint64_t generation = cache_.GetGeneration();
+        
+        std::lock_guard<std::mutex> lock(exp_mtx_);
+        if (!Experiment::IsActive()) {
+            res.status = 400;
+            return;
+        }
+
+        auto experiment = Experiment::Get();
+        std::string etag = MakeETag(experiment->GetId(), experiment->GetVersion());
+        if (req.get_header_value("If-None-Match") == etag) {
+            res.set_header("ETag", etag);
+            res.status = 304;
+            return;
+        }
+
+        json since = json::object();
+        bool delta = request.contains("since") && request["since"].is_object() &&
+            request.value("experiment", experiment->GetId()) == experiment->GetId();
+        if (delta) {
+            since = request["since"];
+        }
+
+        json response;
+        response["experiment"] = experiment->GetId();
+        response["version"] = experiment->GetVersion();
+        response["predictions"] = json::object();
+        response["versions"] = json::object();
+        std::string buffer;
+        for (auto& user : users_) {
+            if (experiment->IsRegistered(user.Id)) {
+                std::string id = std::to_string(user.Id);
+                size_t version = experiment->GetVersion(user.Id);
+                size_t offset = since.value(id, size_t{0});
+                if (delta && offset >= version) {
+                    continue;
+                }
+                buffer.clear();
+                experiment->GetPredictions(user.Id, offset, &buffer);
+                response["predictions"][id] = buffer;
+                response["versions"][id] = version;
+            }
+        }
+
+        ResponseCache::Serve(req, res, cache_.Store(std::move(key), generation, std::move(etag), response.dump()));
+    }
+
+    void WatchPredictions(const httplib::Request& req, httplib::Response& res) {
+        json request;
+        try {
+            request = json::parse(req.body);
+        } catch (json::exception&) {
+            res.status = 400;
+            return;
+        }
+
+        size_t secret = request["secret"];
+        if (!checker_.CheckSecret(secret)) {
+            res.status = 400;
+            return;
+        }
+
+        NHttp::WatchSlots* slots = NHttp::watch_slots_;
+        if (slots && slots->Used.fetch_add(1) >= slots->Limit) {
+            slots->Used.fetch_sub(1);
+            res.status = 503;
+            return;
+        }
+        auto release = [slots](bool) {
+            if (slots) {
+                slots->Used.fetch_sub(1);
+            }
+        };
+
+        size_t seq = request.value("since", stream_.Head());
+        if (seq < stream_.Oldest()) {
+            release(false);
+            res.status = 410;
+            json response;
+            response["oldest"] = stream_.Oldest();
+            NHttp::SendJson(req, res, response.dump());
+            return;
+        }
+
+        res.status = 200;
+        res.set_chunked_content_provider("application/x-ndjson", [this, seq](size_t, httplib::DataSink& sink) mutable {
+            stream_.Wait(seq, std::chrono::seconds(1));
+
+            std::string chunk;
+            PredictionStream::Event event;
+            for (;;) {
+                auto status = stream_.Read(seq, &event);
+                if (status == PredictionStream::ReadStatus::Empty) {
+                    break;
+                }
+                if (status == PredictionStream::ReadStatus::Overrun) {
+                    json line;
+                    line["error"] = "overrun";
+                    line["next"] = seq;
+                    line["oldest"] = stream_.Oldest();
+                    chunk += line.dump() + "\n";
+                    sink.write(chunk.data(), chunk.size());
+                    sink.done();
+                    return true;
+                }
+
+                json line;
+                line["seq"] = event.Seq;
+                line["id"] = event.Id;
+                line["pred"] = event.Pred;
+                chunk += line.dump() + "\n";
+                ++seq;
+            }
+
+            if (chunk.empty()) {
+                chunk = "\n";
+            }
+            return sink.write(chunk.data(), chunk.size());
+        }, release);
+    }
+
+    void GetLimits(const httplib::Request& req, httplib::Response& res) {
+        json request;
+        try {
+            request = json::parse(req.body);
+        } catch (json::exception&) {
+            res.status = 400;
+            return;
+        }
+
+        size_t secret = request["secret"];
+        if (!checker_.CheckSecret(secret)) {
+            res.status = 400;
+            return;
+        }
+
+        size_t users;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            users = users_.size();
+        }
+
+        res.status = 200;
+        NHttp::SendJson(req, res, limiter_.GetStat(users).dump());
+    }
+
+    void GetMemory(const httplib::Request& req, httplib::Response& res) {
+        json request;
+        try {
+            request = json::parse(req.body);
+        } catch (json::exception&) {
+            res.status = 400;
+            return;
+        }
+
+        size_t secret = request["secret"];
+        if (!checker_.CheckSecret(secret)) {
+            res.status = 400;
+            return;
+        }
+
+        json response;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            size_t bytes = users_.capacity() * sizeof(User);
+            for (const auto& user : users_) {
+                if (user.Address.capacity() > std::string().capacity()) {
+                    bytes += user.Address.capacity() + 1;
+                }
+            }
+            response["users"]["count"] = users_.size();
+            response["users"]["bytes"] = bytes;
+        }
+
+        response["quota"]["user_bytes"] = NExperiment::user_quota_;
+        response["quota"]["experiment_bytes"] = NExperiment::experiment_quota_;
+        response["quota"]["policy"] = NExperiment::evict_ ? "evict" : "reject";
+
+        response["experiment"] = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(exp_mtx_);
+            if (Experiment::IsActive()) {
+                auto experiment = Experiment::Get();
+                json& current = response["experiment"];
+                current["id"] = experiment->GetId();
+                current["predictions"] = experiment->GetPredictionCount();
+                current["bytes"] = experiment->GetBytes();
+                current["overhead_bytes"] = experiment->GetOverheadBytes();
+                current["evicted"] = experiment->GetEvictedCount();
+                current["rejected"] = experiment->GetRejectedCount();
+                current["largest"] = json::array();
+                for (auto [bytes, id] : experiment->GetLargest(request.value("top", size_t{10}))) {
+                    current["largest"].push_back({{"id", id}, {"bytes", bytes}, {"evicted", experiment->GetEvicted(id)}});
+                }
+            }
+        }
+
+        response["history"]["segments"] = catalog_.GetSegmentCount();
+        response["history"]["stored_bytes"] = catalog_.GetStoredBytes();
+        response["history"]["resident_bytes"] = catalog_.GetResidentBytes();
+        response["history"]["budget_bytes"] = catalog_.GetBudget();
+
+        response["caches"]["responses"]["entries"] = cache_.GetEntryCount();
+        response["caches"]["responses"]["bytes"] = cache_.GetBytes();
+        response["caches"]["stream_bytes"] = PredictionStream::GetBytes();
+        response["caches"]["limiter_bytes"] = limiter_.GetBytes();
+
+        res.status = 200;
+        NHttp::SendJson(req, res, response.dump());
+    }
+
+    void GetStat(const httplib::Request& req, httplib::Response& res) {
+        json request;
+        try {
+            request = json::parse(req.body);
+        } catch (json::exception&) {
+            res.status = 400;
+            return;
+        }
+
+        size_t secret = request["secret"];
+        if (!checker_.CheckSecret(secret)) {
+            res.status = 400;
+            return;
+        }
+
+        std::string key = ResponseCache::MakeKey(req.path, request);
+        if (auto cached = cache_.Find(key)) {
+            ResponseCache::Serve(req, res, std::move(cached));
+            return;
+        }
+        uint64_t generation = cache_.GetGeneration();
+
+        size_t from;
+        size_t to;
+        ParseRange(request, &from, &to);
+
+        std::optional<Experiment::Snapshot> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(exp_mtx_);
+            auto experiment = Experiment::Get();
+            if (Experiment::IsActive() && from <= experiment->GetId() && experiment->GetId() <= to) {
+                snapshot = experiment->TakeSnapshot();
+            }
+        }
+
+        auto segments = catalog_.Range(from, to);
+        std::shared_ptr<const Segment> current;
+        std::vector<json> old(segments.size());
+        compute_.Run(segments.size() + snapshot.has_value(), [&](size_t item, size_t) {
+            if (item == segments.size()) {
+                current = snapshot->Encode();
+                return;
+            }
+
+            const auto& segment = segments[item];
+            old[item]["start"] = Segment::Clock::to_time_t(segment->GetStart());
+            old[item]["stop"] = Segment::Clock::to_time_t(segment->GetStop());
+
+            const auto& total = segment->GetAggregate();
+            old[item]["count"] = total.Count;
+            old[item]["evicted"] = segment->GetEvicted();
+            old[item]["sum"] = total.Sum;
+            if (total.Count) {
+                old[item]["min"] = total.Min;
+                old[item]["max"] = total.Max;
+            }
+
+            old[item]["predictions"] = json::object();
+            std::string buffer;
+            for (size_t i = 0; i < segment->GetUserCount(); ++i) {
+                buffer.clear();
+                segment->GetPredictions(i, &buffer);
+                old[item]["predictions"][std::to_string(segment->GetUser(i))] = buffer;
+            }
+        });
+
+        json response;
+        if (current) {
+            std::string buffer;
+            for (size_t i = 0; i < current->GetUserCount(); ++i) {
+                buffer.clear();
+                current->GetPredictions(i, &buffer);
+                response["Current"][std::to_string(current->GetUser(i))] = buffer;
+            }
+            response["CurrentEvicted"] = current->GetEvicted();
+        }
+
+        response["Old"] = json::object();
+        for (size_t i = 0; i < segments.size(); ++i) {
+            response["Old"][std::to_string(segments[i]->GetId())] = std::move(old[i]);
+        }
+
+        ResponseCache::Serve(req, res, cache_.Store(std::move(key), generation, "", response.dump()));
+    }
+
+
+    void Aggregate(const httplib::Request& req, httplib::Response& res) {
+        json request;
+        try {
+            request = json::parse(req.body);
+        } catch (json::exception&) {
+            res.status = 400;
+            return;
+        }
+
+        size_t secret = request["secret"];
+        if (!checker_.CheckSecret(secret)) {
+            res.status = 400;
+            return;
+        }
+
+        std::string key = ResponseCache::MakeKey(req.path, request);
+        if (auto cached = cache_.Find(key)) {
+            ResponseCache::Serve(req, res, std::move(cached));
+            return;
+        }
+        uint64_t generation = cache_.GetGeneration();
+
+        size_t from;
+        size_t to;
+        ParseRange(request, &from, &to);
+
+        bool by_user = request.contains("id");
+        size_t user = request.value("id", size_t{0});
+
+        long long base = 0;
+        long long width = 1;
+        std::vector<size_t> buckets;
+        if (request.contains("histogram")) {
+            base = request["histogram"].value("base", 0ll);
+            width = request["histogram"].value("width", 1ll);
+            size_t count = request["histogram"].value("buckets", size_t{0});
+            if (width <= 0 || count == 0 || count > kMaxBuckets) {
+                res.status = 400;
+                return;
+            }
+            buckets.resize(count);
+        }
+
+        bool filter = request.contains("filter");
+        int lo = filter ? request["filter"].value("lo", std::numeric_limits<int>::min()) : 0;
+        int hi = filter ? request["filter"].value("hi", std::numeric_limits<int>::max()) : 0;
+
+        std::optional<Experiment::Snapshot> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(exp_mtx_);
+            auto experiment = Experiment::Get();
+            if (Experiment::IsActive() && from <= experiment->GetId() && experiment->GetId() <= to) {
+                snapshot = experiment->TakeSnapshot();
+            }
+        }
+
+        auto segments = catalog_.Range(from, to);
+        if (snapshot) {
+            segments.push_back(snapshot->Encode());
+        }
+
+        struct Part {
+            const Segment* Source;
+            size_t First;
+            size_t Last;
+        };
+
+        bool scan = filter || !buckets.empty();
+        Segment::Aggregate total;
+        size_t evicted = 0;
+        std::vector<Part> parts;
+        for (const auto& segment : segments) {
+            if (by_user) {
+                size_t index = segment->Find(user);
+                if (index == segment->GetUserCount() || segment->GetUser(index) != user) {
+                    continue;
+                }
+                total.Merge(segment->GetAggregate(index));
+                evicted += segment->GetEvicted(index);
+                parts.push_back({segment.get(), index, index + 1});
+                continue;
+            }
+
+            total.Merge(segment->GetAggregate());
+            evicted += segment->GetEvicted();
+            for (size_t first = 0, last = 0; first < segment->GetUserCount(); first = last) {
+                size_t values = 0;
+                while (last < segment->GetUserCount() && values < kPartValues) {
+                    values += segment->GetAggregate(last++).Count;
+                }
+                parts.push_back({segment.get(), first, last});
+            }
+        }
+
+        const auto& kernels = AggregationKernels::Get();
+        std::vector<size_t> histogram = buckets;
+        size_t matched = 0;
+        if (scan && !parts.empty()) {
+            struct Partial {
+                std::vector<size_t> Buckets;
+                size_t Matched = 0;
+            };
+            std::vector<Partial> partials(compute_.GetWorkers(parts.size()), Partial{buckets, 0});
+
+            compute_.Run(parts.size(), [&](size_t item, size_t worker) {
+                const Part& part = parts[item];
+                Partial& partial = partials[worker];
+                for (size_t i = part.First; i < part.Last; ++i) {
+                    part.Source->ForEachBlock(i, [&](const int* begin, const int* end) {
+                        if (!partial.Buckets.empty()) {
+                            kernels.Histogram(begin, end - begin, base, width,
+                                              partial.Buckets.data(), partial.Buckets.size());
+                        }
+                        if (filter) {
+                            partial.Matched += kernels.CountInRange(begin, end - begin, lo, hi);
+                        }
+                    });
+                }
+            });
+
+            for (const auto& partial : partials) {
+                for (size_t i = 0; i < histogram.size(); ++i) {
+                    histogram[i] += partial.Buckets[i];
+                }
+                matched += partial.Matched;
+            }
+        }
+
+        json response;
+        response["kernel"] = kernels.Name;
+        response["count"] = total.Count;
+        response["evicted"] = evicted;
+        response["sum"] = total.Sum;
+        if (total.Count) {
+            response["min"] = total.Min;
+            response["max"] = total.Max;
+        }
+        if (!histogram.empty()) {
+            response["histogram"] = histogram;
+        }
+        if (filter) {
+            response["matched"] = matched;
+        }
+
+        ResponseCache::Serve(req, res, cache_.Store(std::move(key), generation, "", response.dump()));
+    }
+
+
+private:
+
+    static constexpr size_t kMaxBuckets = 1 << 16;
+    static constexpr size_t kPartValues = 1 << 16;
+    static constexpr size_t kMaxQueryParallelism = 4;
+
+    static void ParseRange(const json& request, size_t* from, size_t* to) {
+        *from = 0;
+        *to = std::numeric_limits<size_t>::max();
+        if (request.contains("experiment")) {
+            *from = *to = request["experiment"].get<size_t>();
+        } else {
+            *from = request.value("from", *from);
+            *to = request.value("to", *to);
+        }
+    }
+
+    static void Throttle(httplib::Response& res) {
+        res.status = 429;
+        res.set_header("Retry-After", "1");
+    }
+
+    static std::string MakeETag(size_t experiment, size_t version) {
+        return "\"" + std::to_string(experiment) + "-" + std::to_string(version) + "\"";
+    }
+
+    std::mutex mtx_;
+    std::mutex exp_mtx_;
+    std::vector<User> users_;
+    RateLimiter limiter_;
+
+    Checker checker_;
+    PredictionStream stream_;
+
+    SegmentCatalog catalog_;
+    ComputePool compute_;
+    ResponseCache cache_;
+    Notifier notifier_;
+};
+
+#ifdef SERVER_IO_URING
+class IoUring {
+public:
+
+    explicit IoUring(unsigned entries) {
+        io_uring_params params{};
+        fd_ = ::syscall(__NR_io_uring_setup, entries, &params);
+        if (fd_ < 0) {
+            return;
+        }
+
+        sq_entries_ = params.sq_entries;
+        sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+        }
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+
+        sq_ptr_ = ::mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        cq_ptr_ = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_ptr_ :
+            ::mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+        void* sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+        if (sq_ptr_ == MAP_FAILED || cq_ptr_ == MAP_FAILED || sqes == MAP_FAILED) {
+            Close();
+            return;
+        }
+
+        char* sq = static_cast<char*>(sq_ptr_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+        sq_local_tail_ = *sq_tail_;
+
+        char* cq = static_cast<char*>(cq_ptr_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    ~IoUring() {
+        Close();
+    }
+
+    bool IsValid() const {
+        return fd_ >= 0;
+    }
+
+    unsigned GetFree() const {
+        return sq_entries_ - (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE));
+    }
+
+    io_uring_sqe* GetSqe() {
+        if (GetFree() == 0) {
+            return nullptr;
+        }
+
+        unsigned index = sq_local_tail_++ & sq_mask_;
+        io_uring_sqe* sqe = &sqes_[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array_[index] = index;
+        return sqe;
+    }
+
+    int Submit(unsigned wait) {
+        __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+
+        int ret;
+        do {
+            unsigned pending = sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+            ret = ::syscall(__NR_io_uring_enter, fd_, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        } while (ret < 0 && errno == EINTR);
+        return ret;
+    }
+
+    // Takes back the entries the kernel has not consumed yet and returns how many there were.
+    unsigned Retract() {
+        unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        unsigned count = sq_local_tail_ - head;
+        sq_local_tail_ = head;
+        __atomic_store_n(sq_tail_, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    bool PeekCqe(io_uring_cqe* cqe) {
+        unsigned head = *cq_head_;
+        if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+
+        *cqe = cqes_[head & cq_mask_];
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    bool RegisterBuffers(const iovec* buffers, unsigned count) {
+        return ::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+    }
+
+private:
+
+    void Close() {
+        if (sqes_) {
+            ::munmap(sqes_, sqes_size_);
+        }
+        if (cq_ptr_ && cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_) {
+            ::munmap(cq_ptr_, cq_size_);
+        }
+        if (sq_ptr_ && sq_ptr_ != MAP_FAILED) {
+            ::munmap(sq_ptr_, sq_size_);
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+        sqes_ = nullptr;
+        sq_ptr_ = cq_ptr_ = nullptr;
+        fd_ = -1;
+    }
+
+    int fd_ = -1;
+
+    void* sq_ptr_ = nullptr;
+    void* cq_ptr_ = nullptr;
+    size_t sq_size_ = 0;
+    size_t cq_size_ = 0;
+    size_t sqes_size_ = 0;
+
+    unsigned sq_entries_ = 0;
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned* sq_array_ = nullptr;
+    io_uring_sqe* sqes_ = nullptr;
+    unsigned sq_local_tail_ = 0;
+
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+};
+
+#endif
+
+class ConnectionStream final : public httplib::Stream {
+public:
+
+    static constexpr size_t kBufferSize = 64 * 1024;
+    static constexpr size_t kCoalesceSize = 16 * 1024;
+
+    ConnectionStream(socket_t sock, time_t read_timeout_sec, time_t read_timeout_usec,
+                     time_t write_timeout_sec, time_t write_timeout_usec)
+        : sock_(sock)
+        , read_timeout_{read_timeout_sec, read_timeout_usec * 1000}
+        , write_timeout_{write_timeout_sec, write_timeout_usec * 1000}
+    {
+    }
+
+    bool HasBuffered() const {
+        return offset_ < size_;
+    }
+
+    bool Fill() {
+        if (HasBuffered()) {
+            return true;
+        }
+
+        int ret = Receive(Local().Buffer.get(), kBufferSize);
+        if (ret <= 0) {
+            return false;
+        }
+        offset_ = 0;
+        size_ = ret;
+        return true;
+    }
+
+    std::string_view GetBuffered() const {
+        return {Local().Buffer.get() + offset_, size_ - offset_};
+    }
+
+    void Consume(size_t size) {
+        offset_ += size;
+    }
+
+    bool WaitReadable(timespec timeout) const {
+        return HasBuffered() || Run({Operation::Poll, nullptr, 0}, timeout) > 0;
+    }
+
+    bool is_readable() const override {
+        return WaitReadable(read_timeout_);
+    }
+
+    // A streaming response only learns that its peer left from here, between chunks.
+    bool is_writable() const override {
+        return !streaming_ || httplib::detail::is_socket_alive(sock_);
+    }
+
+    ssize_t read(char* ptr, size_t size) override {
+        if (offset_ == size_) {
+            int ret = Receive(Local().Buffer.get(), kBufferSize);
+            if (ret <= 0) {
+                return ret < 0 ? -1 : 0;
+            }
+
+            offset_ = 0;
+            size_ = ret;
+        }
+
+        size_t n = std::min(size, size_ - offset_);
+        std::memcpy(ptr, Local().Buffer.get() + offset_, n);
+        offset_ += n;
+        return n;
+    }
+
+    bool ReadView(size_t length, std::string_view* out) {
+        char* buffer = Local().Buffer.get();
+        if (size_ - offset_ < length) {
+            std::memmove(buffer, buffer + offset_, size_ - offset_);
+            size_ -= offset_;
+            offset_ = 0;
+            while (size_ < length) {
+                int ret = Receive(buffer + size_, kBufferSize - size_);
+                if (ret <= 0) {
+                    return false;
+                }
+                size_ += ret;
+            }
+        }
+
+        *out = {buffer + offset_, length};
+        offset_ += length;
+        return true;
+    }
+
+    // Small writes are held back and leave in one sendmsg with whatever follows them,
+    // so httplib's separate head and body writes become a single segment. A streaming
+    // response sends its head with MSG_MORE and pushes every chunk after it.
+    ssize_t write(const char* ptr, size_t size) override {
+        std::string& pending = Local().Pending;
+        if (!streaming_ && pending.size() + size <= kCoalesceSize) {
+            pending.append(ptr, size);
+            return size;
+        }
+
+        int flags = streaming_ && !head_sent_ ? MSG_MORE : 0;
+        head_sent_ = true;
+        iovec iov[] = {{pending.data(), pending.size()}, {const_cast<char*>(ptr), size}};
+        bool ok = WriteV(iov, 2, flags);
+        pending.clear();
+        return ok ? size : -1;
+    }
+
+    bool Flush() {
+        std::string& pending = Local().Pending;
+        if (pending.empty()) {
+            return true;
+        }
+
+        iovec iov{pending.data(), pending.size()};
+        bool ok = WriteV(&iov, 1);
+        pending.clear();
+        return ok;
+    }
+
+    // While further pipelined requests are already buffered the response is only queued;
+    // the last response of the batch carries all of them in one sendmsg.
+    bool WriteResponse(std::string_view head, std::string_view body) {
+        if (HasBuffered()) {
+            return write(head.data(), head.size()) >= 0 && write(body.data(), body.size()) >= 0;
+        }
+
+        std::string& pending = Local().Pending;
+        iovec iov[] = {
+            {pending.data(), pending.size()},
+            {const_cast<char*>(head.data()), head.size()},
+            {const_cast<char*>(body.data()), body.size()},
+        };
+        bool ok = WriteV(iov, 3);
+        pending.clear();
+        return ok;
+    }
+
+    bool WriteV(iovec* iov, size_t count, int flags = 0) {
+        msghdr message{};
+        message.msg_iov = iov;
+        message.msg_iovlen = count;
+        while (message.msg_iovlen) {
+            int ret = Run({Operation::Send, nullptr, 0, &message, flags}, write_timeout_);
+            if (ret < 0) {
+                return false;
+            }
+
+            size_t sent = ret;
+            while (message.msg_iovlen && sent >= message.msg_iov->iov_len) {
+                sent -= message.msg_iov->iov_len;
+                ++message.msg_iov;
+                --message.msg_iovlen;
+            }
+            if (message.msg_iovlen) {
+                message.msg_iov->iov_base = static_cast<char*>(message.msg_iov->iov_base) + sent;
+                message.msg_iov->iov_len -= sent;
+            }
+        }
+        return true;
+    }
+
+    void SetStreaming(bool streaming) {
+        streaming_ = streaming;
+        head_sent_ = false;
+    }
+
+    void get_remote_ip_and_port(std::string& ip, int& port) const override {
+        httplib::detail::get_remote_ip_and_port(sock_, ip, port);
+    }
+
+    void get_local_ip_and_port(std::string& ip, int& port) const override {
+        httplib::detail::get_local_ip_and_port(sock_, ip, port);
+    }
+
+    socket_t socket() const override {
+        return sock_;
+    }
+
+private:
+
+    struct Operation {
+        enum { Poll, Recv, Send } Kind;
+        char* Data;
+        size_t Size;
+        msghdr* Message = nullptr;
+        int Flags = 0;
+    };
+
+    struct ThreadLocal {
+        std::unique_ptr<char[]> Buffer{new char[kBufferSize]};
+        std::string Pending;
+#ifdef SERVER_IO_URING
+        IoUring Ring{8};
+        bool Registered = false;
+
+        ThreadLocal() {
+            iovec buffer{Buffer.get(), kBufferSize};
+            Registered = Ring.IsValid() && Ring.RegisterBuffers(&buffer, 1);
+        }
+#endif
+    };
+
+    static ThreadLocal& Local() {
+        thread_local ThreadLocal local;
+        return local;
+    }
+
+    // Queued pipelined responses go out before blocking: the peer may be waiting for them.
+    int Receive(char* data, size_t size) {
+        if (!Flush()) {
+            return -1;
+        }
+        return Run({Operation::Recv, data, size}, read_timeout_);
+    }
+
+    int Run(Operation op, timespec timeout) const {
+#ifdef SERVER_IO_URING
+        if (Local().Ring.IsValid()) {
+            return RunRing(op, timeout);
+        }
+#endif
+        return RunBlocking(op, timeout);
+    }
+
+#ifdef SERVER_IO_URING
+    int RunRing(Operation op, timespec timeout) const {
+        ThreadLocal& local = Local();
+        IoUring& ring = local.Ring;
+        // Each call reaps everything it queued, so this only trips if the ring was left dirty.
+        if (ring.GetFree() < 2) {
+            return RunBlocking(op, timeout);
+        }
+
+        io_uring_sqe* sqe = ring.GetSqe();
+        sqe->fd = sock_;
+        switch (op.Kind) {
+        case Operation::Poll:
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = POLLIN;
+            break;
+        case Operation::Recv:
+            sqe->opcode = local.Registered ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+            sqe->buf_index = 0;
+            break;
+        case Operation::Send:
+            sqe->opcode = op.Message ? IORING_OP_SENDMSG : IORING_OP_SEND;
+            sqe->msg_flags = MSG_NOSIGNAL | op.Flags;
+            break;
+        }
+        sqe->addr = op.Message ? reinterpret_cast<uint64_t>(op.Message) : reinterpret_cast<uint64_t>(op.Data);
+        sqe->len = op.Message ? 1 : op.Size;
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe->user_data = kOperation;
+
+        __kernel_timespec limit{timeout.tv_sec, timeout.tv_nsec};
+        io_uring_sqe* link = ring.GetSqe();
+        link->opcode = IORING_OP_LINK_TIMEOUT;
+        link->addr = reinterpret_cast<uint64_t>(&limit);
+        link->len = 1;
+        link->user_data = kTimeout;
+
+        int result = -ETIME;
+        for (int pending = 2; pending > 0;) {
+            if (ring.Submit(1) < 0) {
+                int error = errno;
+                Abandon(&ring, pending);
+                return -error;
+            }
+
+            io_uring_cqe cqe;
+            while (ring.PeekCqe(&cqe)) {
+                if (cqe.user_data == kOperation) {
+                    result = cqe.res;
+                }
+                --pending;
+            }
+        }
+        return result;
+    }
+
+    // After a failed submit the operation and its timeout may still be queued or in flight, and
+    // they point at the caller's data and at RunRing's stack. Entries the kernel has not taken
+    // are withdrawn; anything it has taken is cancelled and reaped before RunRing returns.
+    static void Abandon(IoUring* ring, int pending) {
+        pending -= ring->Retract();
+        if (pending > 0) {
+            io_uring_sqe* cancel = ring->GetSqe();
+            cancel->opcode = IORING_OP_ASYNC_CANCEL;
+            cancel->addr = kOperation;
+            cancel->user_data = kCancel;
+            ++pending;
+        }
+
+        while (pending > 0) {
+            if (ring->Submit(1) < 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+
+            io_uring_cqe cqe;
+            while (ring->PeekCqe(&cqe)) {
+                --pending;
+            }
+        }
+    }
+
+    static constexpr uint64_t kOperation = 1;
+    static constexpr uint64_t kTimeout = 2;
+    static constexpr uint64_t kCancel = 3;
+#endif
+
+    int RunBlocking(Operation op, timespec timeout) const {
+        if (op.Kind != Operation::Poll) {
+            ssize_t ret = Transfer(op, MSG_DONTWAIT);
+            if (ret >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                return ret < 0 ? -errno : ret;
+            }
+        }
+
+        pollfd pfd{sock_, static_cast<short>(op.Kind == Operation::Send ? POLLOUT : POLLIN), 0};
+        int ready = ::poll(&pfd, 1, timeout.tv_sec * 1000 + timeout.tv_nsec / 1000000);
+        if (ready <= 0 || op.Kind == Operation::Poll) {
+            return ready < 0 ? -errno : ready == 0 ? -ETIME : ready;
+        }
+
+        ssize_t ret = Transfer(op, 0);
+        return ret < 0 ? -errno : ret;
+    }
+
+    ssize_t Transfer(const Operation& op, int flags) const {
+        if (op.Kind == Operation::Recv) {
+            return ::recv(sock_, op.Data, op.Size, flags);
+        }
+
+        flags |= MSG_NOSIGNAL | op.Flags;
+        return op.Message ? ::sendmsg(sock_, op.Message, flags) : ::send(sock_, op.Data, op.Size, flags);
+    }
+
+    socket_t sock_;
+    timespec read_timeout_;
+    timespec write_timeout_;
+
+    size_t offset_ = 0;
+    size_t size_ = 0;
+    bool streaming_ = false;
+    bool head_sent_ = false;
+};
+
+class TimerWheel {
+public:
+
+    struct Timer {
+        socket_t Sock;
+        uint64_t Generation;
+        uint64_t Deadline;
+    };
+
+    static constexpr uint64_t kNever = std::numeric_limits<uint64_t>::max();
+
+    explicit TimerWheel(uint64_t now)
+        : current_(now)
+    {
+    }
+
+    bool IsEmpty() const {
+        return size_ == 0;
+    }
+
+    void Add(Timer timer) {
+        timer.Deadline = std::max(timer.Deadline, current_ + 1);
+        uint64_t delta = timer.Deadline - current_;
+        if (delta < kSlots) {
+            near_[timer.Deadline % kSlots].push_back(timer);
+        } else if (delta < kSlots * kSlots) {
+            far_[(timer.Deadline / kSlots) % kSlots].push_back(timer);
+        } else {
+            far_[(current_ / kSlots + kSlots - 1) % kSlots].push_back(timer);
+        }
+        ++size_;
+    }
+
+    template <typename F>
+    void Advance(uint64_t now, F&& expire) {
+        while (current_ < now && size_) {
+            ++current_;
+            if (current_ % kSlots == 0) {
+                scratch_.swap(far_[(current_ / kSlots) % kSlots]);
+                size_ -= scratch_.size();
+                for (const auto& timer : scratch_) {
+                    Add(timer);
+                }
+                scratch_.clear();
+            }
+
+            scratch_.swap(near_[current_ % kSlots]);
+            size_ -= scratch_.size();
+            for (const auto& timer : scratch_) {
+                expire(timer);
+            }
+            scratch_.clear();
+        }
+        current_ = std::max(current_, now);
+    }
+
+    uint64_t NextExpiry() const {
+        if (!size_) {
+            return kNever;
+        }
+        for (uint64_t tick = current_ + 1; tick % kSlots != 0; ++tick) {
+            if (!near_[tick % kSlots].empty()) {
+                return tick;
+            }
+        }
+        return (current_ / kSlots + 1) * kSlots;
+    }
+
+private:
+    static constexpr uint64_t kSlots = 256;
+
+    std::array<std::vector<Timer>, kSlots> near_;
+    std::array<std::vector<Timer>, kSlots> far_;
+    std::vector<Timer> scratch_;
+    uint64_t current_;
+    size_t size_ = 0;
+};
+
+class Exchange {
+public:
+
+    static constexpr size_t kArenaSize = 64 * 1024;
+    static constexpr size_t kMaxSpareHeaders = 64;
+
+    httplib::Request Request;
+    httplib::Response Response;
+
+    static Exchange& Local() {
+        thread_local Exchange exchange;
+        return exchange;
+    }
+
+    void AddHeader(std::string_view name, std::string_view value) {
+        if (spare_.empty()) {
+            Request.headers.emplace(name, value);
+            return;
+        }
+
+        auto node = std::move(spare_.back());
+        spare_.pop_back();
+        node.key().assign(name);
+        node.mapped().assign(value);
+        Request.headers.insert(std::move(node));
+    }
+
+    std::pmr::memory_resource* GetArena() {
+        return &arena_;
+    }
+
+    void Reset() {
+        Recycle(&Request.headers);
+        Recycle(&Response.headers);
+        Request.body.clear();
+        Response.body.clear();
+        Response.status = -1;
+        Response.content_length_ = 0;
+        Response.content_provider_ = nullptr;
+        if (Response.content_provider_resource_releaser_) {
+            Response.content_provider_resource_releaser_(Response.content_provider_success_);
+            Response.content_provider_resource_releaser_ = nullptr;
+        }
+        Response.is_chunked_content_provider_ = false;
+        Response.content_provider_success_ = false;
+        NHttp::arena_ = nullptr;
+        arena_.release();
+    }
+
+private:
+
+    Exchange()
+        : buffer_(new std::byte[kArenaSize])
+        , arena_(buffer_.get(), kArenaSize)
+    {
+        spare_.reserve(kMaxSpareHeaders);
+    }
+
+    void Recycle(httplib::Headers* headers) {
+        while (!headers->empty()) {
+            auto node = headers->extract(headers->begin());
+            if (spare_.size() < kMaxSpareHeaders) {
+                spare_.push_back(std::move(node));
+            }
+        }
+    }
+
+    std::vector<httplib::Headers::node_type> spare_;
+    std::unique_ptr<std::byte[]> buffer_;
+    std::pmr::monotonic_buffer_resource arena_;
+};
+
+struct Connection {
+    socket_t Sock;
+    size_t Remaining;
+    std::string RemoteAddr;
+    int RemotePort = 0;
+    std::string LocalAddr;
+    int LocalPort = 0;
+};
+
+class IdleParker {
+public:
+
+    using Callback = std::function<void(std::shared_ptr<Connection>)>;
+
+    static constexpr std::chrono::milliseconds kTick{100};
+
+    IdleParker(Callback resume, Callback expire)
+        : resume_(std::move(resume))
+        , expire_(std::move(expire))
+        , epoll_fd_(::epoll_create1(EPOLL_CLOEXEC))
+        , wake_fd_(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+        , wheel_(Now())
+    {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = wake_fd_;
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event);
+
+        thread_ = std::thread([this] { Loop(); });
+    }
+
+    IdleParker(const IdleParker&) = delete;
+    IdleParker& operator=(const IdleParker&) = delete;
+
+    ~IdleParker() {
+        stop_ = true;
+        Wake();
+        thread_.join();
+        ::close(wake_fd_);
+        ::close(epoll_fd_);
+    }
+
+    void Park(std::shared_ptr<Connection> connection, std::chrono::milliseconds timeout) {
+        socket_t sock = connection->Sock;
+        uint64_t deadline = Now() + (timeout + kTick - std::chrono::milliseconds(1)) / kTick;
+
+        bool wake = false;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            uint64_t generation = ++generation_;
+            if (static_cast<size_t>(sock) >= parked_.size()) {
+                parked_.resize(sock + 1);
+            }
+            parked_count_ += !parked_[sock].Client;
+            parked_[sock] = {std::move(connection), generation};
+            wheel_.Add({sock, generation, deadline});
+            wake = deadline < wake_at_;
+        }
+
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        event.data.fd = sock;
+        if (::epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, sock, &event) != 0) {
+            ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, sock, &event);
+        }
+
+        if (wake) {
+            Wake();
+        }
+    }
+
+    size_t GetParked() const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return parked_count_;
+    }
+
+private:
+
+    struct Parked {
+        std::shared_ptr<Connection> Client;
+        uint64_t Generation;
+    };
+
+    static uint64_t Now() {
+        return std::chrono::steady_clock::now().time_since_epoch() / kTick;
+    }
+
+    void Wake() {
+        uint64_t one = 1;
+        [[maybe_unused]] auto _ = ::write(wake_fd_, &one, sizeof(one));
+    }
+
+    void Loop() {
+        std::array<epoll_event, 256> events;
+        while (!stop_) {
+            int timeout = -1;
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                wake_at_ = wheel_.NextExpiry();
+                if (wake_at_ != TimerWheel::kNever) {
+                    timeout = std::max<int64_t>(wake_at_ - Now(), 0) * kTick.count();
+                }
+            }
+
+            int ready = ::epoll_wait(epoll_fd_, events.data(), events.size(), timeout);
+
+            {
+                std::lock_guard<std::mutex> lock(mtx_);
+                for (int i = 0; i < ready; ++i) {
+                    int fd = events[i].data.fd;
+                    if (fd == wake_fd_) {
+                        uint64_t value;
+                        [[maybe_unused]] auto _ = ::read(wake_fd_, &value, sizeof(value));
+                        continue;
+                    }
+
+                    if (Take(fd, 0, &resumed_)) {
+                        --parked_count_;
+                    }
+                }
+
+                wheel_.Advance(Now(), [&](const TimerWheel::Timer& timer) {
+                    if (Take(timer.Sock, timer.Generation, &expired_)) {
+                        --parked_count_;
+                    }
+                });
+            }
+
+            for (auto& connection : expired_) {
+                ::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, connection->Sock, nullptr);
+                expire_(std::move(connection));
+            }
+            for (auto& connection : resumed_) {
+                resume_(std::move(connection));
+            }
+            expired_.clear();
+            resumed_.clear();
+        }
+    }
+
+    bool Take(socket_t sock, uint64_t generation, std::vector<std::shared_ptr<Connection>>* out) {
+        if (static_cast<size_t>(sock) >= parked_.size() || !parked_[sock].Client ||
+            (generation && parked_[sock].Generation != generation)) {
+            return false;
+        }
+        out->push_back(std::move(parked_[sock].Client));
+        return true;
+    }
+
+    Callback resume_;
+    Callback expire_;
+
+    int epoll_fd_;
+    int wake_fd_;
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+    std::vector<std::shared_ptr<Connection>> resumed_;
+    std::vector<std::shared_ptr<Connection>> expired_;
+
+    mutable std::mutex mtx_;
+    std::vector<Parked> parked_;
+    size_t parked_count_ = 0;
+    TimerWheel wheel_;
+    uint64_t generation_ = 0;
+    uint64_t wake_at_ = TimerWheel::kNever;
+};
+
+namespace NRouting {
+    using Handler = void (HttpServer::*)(const httplib::Request&, httplib::Response&);
+    using ViewHandler = void (HttpServer::*)(std::string_view, httplib::Response&);
+    using Gate = bool (HttpServer::*)(httplib::Response&);
+    using Release = void (HttpServer::*)();
+
+    struct Route {
+        std::string_view Method;
+        std::string_view Path;
+        Handler Call;
+        ViewHandler CallView = nullptr;
+        bool Streaming = false;
+        Gate Admit = nullptr;
+        Release Cancel = nullptr;
+    };
+
+    constexpr Route kRoutes[] = {
+        {"POST", "/user/register", &HttpServer::RegisterUser},
+        {"POST", "/user/predict", nullptr, &HttpServer::RegisterPrediction, false, &HttpServer::AdmitPrediction,
+         &HttpServer::CancelPrediction},
+        {"POST", "/user/get", &HttpServer::GetPredictions},
+        {"POST", "/admin/start", &HttpServer::StartExperiment},
+        {"POST", "/admin/stop", &HttpServer::StopExperiment},
+        {"POST", "/admin/answer", &HttpServer::AnswerToUser},
+        {"POST", "/admin/get", &HttpServer::GetWaiters},
+        {"POST", "/admin/watch", &HttpServer::WatchPredictions, nullptr, true},
+        {"POST", "/admin/aggregate", &HttpServer::Aggregate},
+        {"POST", "/admin/stat", &HttpServer::GetStat},
+        {"POST", "/admin/limits", &HttpServer::GetLimits},
+        {"POST", "/admin/memory", &HttpServer::GetMemory},
+    };
+
+    constexpr size_t kRouteCount = std::size(kRoutes);
+    constexpr size_t kSlots = 32;
+
+    constexpr uint32_t Hash(std::string_view method, std::string_view path, uint32_t seed) {
+        uint32_t hash = 2166136261u ^ seed;
+        for (char c : method) {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+        }
+        for (char c : path) {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+        }
+        return hash ^ (hash >> 15);
+    }
+
+    constexpr bool IsPerfect(uint32_t seed) {
+        bool used[kSlots] = {};
+        for (const Route& route : kRoutes) {
+            size_t slot = Hash(route.Method, route.Path, seed) % kSlots;
+            if (used[slot]) {
+                return false;
+            }
+            used[slot] = true;
+        }
+        return true;
+    }
+
+    constexpr uint32_t FindSeed() {
+        uint32_t seed = 0;
+        while (!IsPerfect(seed)) {
+            ++seed;
+        }
+        return seed;
+    }
+
+    constexpr uint32_t kSeed = FindSeed();
+
+    constexpr std::array<uint8_t, kSlots> MakeTable() {
+        std::array<uint8_t, kSlots> table{};
+        for (size_t slot = 0; slot < kSlots; ++slot) {
+            table[slot] = kRouteCount;
+        }
+        for (size_t i = 0; i < kRouteCount; ++i) {
+            table[Hash(kRoutes[i].Method, kRoutes[i].Path, kSeed) % kSlots] = i;
+        }
+        return table;
+    }
+
+    constexpr std::array<uint8_t, kSlots> kTable = MakeTable();
+
+    static_assert(kRouteCount < kSlots && IsPerfect(kSeed));
+
+    inline const Route* Find(std::string_view method, std::string_view path) {
+        uint8_t index = kTable[Hash(method, path, kSeed) % kSlots];
+        if (index == kRouteCount || kRoutes[index].Path != path || kRoutes[index].Method != method) {
+            return nullptr;
+        }
+        return &kRoutes[index];
+    }
+}
+
+class Listener : public httplib::Server {
+public:
+
+    // Hides httplib::Server::listen: connections are accepted and served here.
+    bool listen(const std::string& host, int port) {
+        return bind_to_port(host, port) && listen_after_bind();
+    }
+
+    // Hides httplib::Server::listen_after_bind, so that main can bind every socket before serving.
+    bool listen_after_bind() {
+        queue_.reset(new_task_queue());
+        parker_ = std::make_unique<IdleParker>(
+            [this](std::shared_ptr<Connection> connection) {
+                if (!queue_->enqueue([this, connection] { Serve(connection); })) {
+                    Close(*connection);
+                }
+            },
+            [this](std::shared_ptr<Connection> connection) {
+                Close(*connection);
+            });
+
+#ifdef SERVER_IO_URING
+        IoUring ring(kAcceptBatch * 2);
+        if (ring.IsValid()) {
+            AcceptRing(&ring);
+        } else {
+            AcceptBlocking();
+        }
+#else
+        AcceptBlocking();
+#endif
+
+        queue_->shutdown();
+        return true;
+    }
+
+    // Hides httplib::Server::stop, which does nothing unless httplib's own listen loop is running.
+    void stop() {
+        socket_t sock = svr_sock_.exchange(INVALID_SOCKET);
+        if (sock != INVALID_SOCKET) {
+            httplib::detail::shutdown_socket(sock);
+            httplib::detail::close_socket(sock);
+        }
+    }
+
+    // Watch streams this listener's pool may hold at once; with the default of 0 all get 503.
+    void SetMaxWatchers(size_t limit) {
+        watch_slots_.Limit = limit;
+    }
 
+    void Route(HttpServer* server) {
+        server_ = server;
+        set_pre_routing_handler([this](const httplib::Request& req, httplib::Response& res) {
+            const NRouting::Route* route = NRouting::Find(req.method, req.path);
+            if (!route) {
+                return httplib::Server::HandlerResponse::Unhandled;
+            }
+
+            stream_->SetStreaming(route->Streaming);
+            std::string_view body;
+            bool admitted = !route->Admit || (server_->*route->Admit)(res);
+            bool read = route->CallView || !admitted ? ReadBody(req, res, &body) : ReadBody(req, res);
+            if (!read) {
+                if (admitted && route->Cancel) {
+                    (server_->*route->Cancel)();
+                }
+            } else if (admitted && route->CallView) {
+                (server_->*route->CallView)(body, res);
+            } else if (admitted) {
+                (server_->*route->Call)(req, res);
+            }
+            return httplib::Server::HandlerResponse::Handled;
+        });
+    }
+
+    bool ReadBody(const httplib::Request& req, httplib::Response& res) {
+        auto& request = const_cast<httplib::Request&>(req);
+        int status = 200;
+        bool ok = httplib::detail::read_content(*stream_, request, payload_max_length_, status, nullptr,
+            [&](const char* data, size_t size, uint64_t, uint64_t) {
+                request.body.append(data, size);
+                return true;
+            }, true);
+
+        if (!ok) {
+            Fail(req, res, status);
+        }
+        return ok;
+    }
+
+    bool ReadBody(const httplib::Request& req, httplib::Response& res, std::string_view* body) {
+        uint64_t length = req.get_header_value_u64("Content-Length");
+        if (!req.has_header("Content-Length") || req.has_header("Content-Encoding") ||
+            httplib::detail::is_chunked_transfer_encoding(req.headers) ||
+            length > ConnectionStream::kBufferSize || length > payload_max_length_) {
+            if (!ReadBody(req, res)) {
+                return false;
+            }
+            *body = req.body;
+            return true;
+        }
+
+        if (!stream_->ReadView(length, body)) {
+            Fail(req, res, 400);
+            return false;
+        }
+        return true;
+    }
+
+private:
+
+    void Fail(const httplib::Request& req, httplib::Response& res, int status) {
+        res.status = status;
+        const_cast<httplib::Request&>(req).set_header("Connection", "close");
+        broken_ = true;
+    }
+
+    void AcceptBlocking() {
+        while (svr_sock_ != INVALID_SOCKET) {
+            socket_t sock = ::accept4(svr_sock_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (sock == INVALID_SOCKET) {
+                if (errno == EMFILE || errno == ENFILE) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                } else if (errno == EBADF || errno == EINVAL) {
+                    break;
+                }
+                continue;
+            }
+            Dispatch(sock);
+        }
+    }
+
+#ifdef SERVER_IO_URING
+    static constexpr unsigned kAcceptBatch = 16;
+
+    void AcceptRing(IoUring* ring) {
+        socket_t listener = svr_sock_;
+        for (unsigned i = 0; i < kAcceptBatch; ++i) {
+            PrepareAccept(ring, listener);
+        }
+
+        while (svr_sock_ != INVALID_SOCKET) {
+            if (ring->Submit(1) < 0) {
+                break;
+            }
+
+            io_uring_cqe cqe;
+            while (ring->PeekCqe(&cqe)) {
+                if (cqe.res >= 0) {
+                    Dispatch(cqe.res);
+                } else if (cqe.res == -EBADF || cqe.res == -EINVAL) {
+                    return;
+                }
+                PrepareAccept(ring, listener);
+            }
+        }
+    }
+
+    static void PrepareAccept(IoUring* ring, socket_t listener) {
+        io_uring_sqe* sqe = ring->GetSqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listener;
+        sqe->accept_flags = SOCK_CLOEXEC;
+    }
+#endif
+
+    void Dispatch(socket_t sock) {
+        auto connection = std::make_shared<Connection>();
+        connection->Sock = sock;
+        connection->Remaining = keep_alive_max_count_;
+        httplib::detail::get_remote_ip_and_port(sock, connection->RemoteAddr, connection->RemotePort);
+        httplib::detail::get_local_ip_and_port(sock, connection->LocalAddr, connection->LocalPort);
+
+        pollfd pfd{sock, POLLIN, 0};
+        if (::poll(&pfd, 1, 0) == 0) {
+            parker_->Park(std::move(connection), std::chrono::seconds(keep_alive_timeout_sec_));
+            return;
+        }
+
+        if (!queue_->enqueue([this, connection] { Serve(connection); })) {
+            Close(*connection);
+        }
+    }
+
+    enum class Outcome {
+        Served,
+        Failed,
+        Fallback,
+    };
+
+    static bool IsHeader(std::string_view name, std::string_view expected) {
+        return name.size() == expected.size() && ::strncasecmp(name.data(), expected.data(), name.size()) == 0;
+    }
+
+    // Serves a plain HTTP/1.1 request to a table route with the thread's pooled exchange.
+    // Anything else is left in the buffer for process_request.
+    Outcome ServeFast(ConnectionStream& strm, const Connection& connection, bool& connection_closed) {
+        if (!strm.Fill()) {
+            return Outcome::Failed;
+        }
+
+        std::string_view data = strm.GetBuffered();
+        size_t head = data.find("\r\n\r\n");
+        if (head == std::string_view::npos) {
+            return Outcome::Fallback;
+        }
+
+        size_t line_end = data.find("\r\n");
+        std::string_view line = data.substr(0, line_end);
+        size_t first = line.find(' ');
+        size_t second = line.find(' ', first + 1);
+        if (first == std::string_view::npos || second == std::string_view::npos ||
+            line.substr(second + 1) != "HTTP/1.1") {
+            return Outcome::Fallback;
+        }
+
+        std::string_view method = line.substr(0, first);
+        std::string_view target = line.substr(first + 1, second - first - 1);
+        const NRouting::Route* route = NRouting::Find(method, target);
+        if (!route || route->Streaming) {
+            return Outcome::Fallback;
+        }
+
+        Exchange& exchange = Exchange::Local();
+        exchange.Reset();
+        NHttp::arena_ = exchange.GetArena();
+        httplib::Request& req = exchange.Request;
+        httplib::Response& res = exchange.Response;
+
+        uint64_t length = 0;
+        for (size_t pos = line_end + 2; pos < head + 2;) {
+            size_t end = data.find("\r\n", pos);
+            std::string_view header = data.substr(pos, end - pos);
+            pos = end + 2;
+
+            size_t colon = header.find(':');
+            if (colon == std::string_view::npos) {
+                exchange.Reset();
+                return Outcome::Fallback;
+            }
+            std::string_view name = header.substr(0, colon);
+            std::string_view value = header.substr(NFormat::SkipSpace(header, colon + 1, " \t"));
+            while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+                value.remove_suffix(1);
+            }
+
+            bool bad_length = IsHeader(name, "Content-Length") &&
+                std::from_chars(value.data(), value.data() + value.size(), length).ec != std::errc();
+            if (bad_length || IsHeader(name, "Transfer-Encoding") || IsHeader(name, "Content-Encoding") ||
+                IsHeader(name, "Expect") || IsHeader(name, "Range")) {
+                exchange.Reset();
+                return Outcome::Fallback;
+            }
+            exchange.AddHeader(name, value);
+        }
+
+        if (NHttp::AcceptsGzip(req) || length > ConnectionStream::kBufferSize || length > payload_max_length_) {
+            exchange.Reset();
+            return Outcome::Fallback;
+        }
+
+        strm.Consume(head + 4);
+        req.method.assign(method);
+        req.path.assign(target);
+        req.target.assign(target);
+        req.version.assign("HTTP/1.1");
+        req.remote_addr = connection.RemoteAddr;
+        req.remote_port = connection.RemotePort;
+        req.local_addr = connection.LocalAddr;
+        req.local_port = connection.LocalPort;
+
+        bool close = connection.Remaining == 1 || req.get_header_value("Connection") == "close";
+        connection_closed = close;
+
+        bool admitted = !route->Admit || (server_->*route->Admit)(res);
+
+        std::string_view body;
+        if (!strm.ReadView(length, &body)) {
+            if (admitted && route->Cancel) {
+                (server_->*route->Cancel)();
+            }
+            exchange.Reset();
+            return Outcome::Failed;
+        }
+
+        try {
+            if (admitted && route->CallView) {
+                (server_->*route->CallView)(body, res);
+            } else if (admitted) {
+                req.body.assign(body);
+                (server_->*route->Call)(req, res);
+            }
+        } catch (std::exception&) {
+            res = httplib::Response();
+            res.status = 500;
+        }
+        if (res.status == -1) {
+            res.status = 200;
+        }
+
+        std::pmr::string out(exchange.GetArena());
+        out.reserve(256);
+        auto append_number = [&](uint64_t value) {
+            NFormat::AppendNumber(value, &out);
+        };
+
+        out.append("HTTP/1.1 ");
+        append_number(res.status);
+        out.append(" ").append(httplib::status_message(res.status)).append("\r\n");
+        for (const auto& [name, value] : res.headers) {
+            out.append(name).append(": ").append(value).append("\r\n");
+        }
+        if (close) {
+            out.append("Connection: close\r\n");
+        } else {
+            out.append("Keep-Alive: timeout=");
+            append_number(keep_alive_timeout_sec_);
+            out.append(", max=");
+            append_number(keep_alive_max_count_);
+            out.append("\r\n");
+        }
+
+        size_t content_length = res.content_provider_ ? res.content_length_ : res.body.size();
+        if (content_length && !res.has_header("Content-Type")) {
+            out.append("Content-Type: text/plain\r\n");
+        }
+        out.append("Content-Length: ");
+        append_number(content_length);
+        out.append("\r\n\r\n");
+
+        std::pmr::string content(exchange.GetArena());
+        if (res.content_provider_) {
+            content.reserve(content_length);
+            httplib::DataSink sink;
+            sink.write = [&](const char* data, size_t size) {
+                content.append(data, size);
+                return true;
+            };
+            sink.is_writable = [] { return true; };
+            while (content.size() < content_length) {
+                size_t offset = content.size();
+                if (!res.content_provider_(offset, content_length - offset, sink) || content.size() == offset) {
+                    exchange.Reset();
+                    return Outcome::Failed;
+                }
+            }
+            res.content_provider_success_ = true;
+        }
+
+        bool ok = strm.WriteResponse(out, res.content_provider_ ? std::string_view(content) : std::string_view(res.body));
+        exchange.Reset();
+        return ok ? Outcome::Served : Outcome::Failed;
+    }
+
+    void Serve(std::shared_ptr<Connection> connection) {
+        ConnectionStream strm(connection->Sock, read_timeout_sec_, read_timeout_usec_,
+                              write_timeout_sec_, write_timeout_usec_);
+        stream_ = &strm;
+        broken_ = false;
+        NHttp::watch_slots_ = &watch_slots_;
+
+        while (svr_sock_ != INVALID_SOCKET) {
+            bool connection_closed = false;
+            Outcome outcome = ServeFast(strm, *connection, connection_closed);
+            bool ret = outcome == Outcome::Served;
+            if (outcome == Outcome::Fallback) {
+                ret = process_request(strm, connection->RemoteAddr, connection->RemotePort,
+                                      connection->LocalAddr, connection->LocalPort,
+                                      connection->Remaining == 1, connection_closed, nullptr);
+                strm.SetStreaming(false);
+            }
+            if (!ret || connection_closed || broken_ || --connection->Remaining == 0) {
+                break;
+            }
+
+            if (!strm.HasBuffered()) {
+                if (!strm.Flush()) {
+                    break;
+                }
+
+                parker_->Park(std::move(connection), std::chrono::seconds(keep_alive_timeout_sec_));
+                return;
+            }
+        }
+
+        strm.Flush();
+        Close(*connection);
+    }
+
+    static void Close(const Connection& connection) {
+        httplib::detail::shutdown_socket(connection.Sock);
+        httplib::detail::close_socket(connection.Sock);
+    }
+
+    HttpServer* server_ = nullptr;
+    std::unique_ptr<httplib::TaskQueue> queue_;
+    std::unique_ptr<IdleParker> parker_;
+    NHttp::WatchSlots watch_slots_;
+
+    inline static thread_local ConnectionStream* stream_ = nullptr;
+    inline static thread_local bool broken_ = false;
+};
+
+void PinToCore(size_t core) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % std::max(std::thread::hardware_concurrency(), 1u), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// bench.cpp includes this file with SERVER_NO_MAIN to measure its pieces in process.
+#ifndef SERVER_NO_MAIN
+int main(int argc, char* argv[]) {
+    size_t threads = std::atoi(argv[1]);
+    size_t queue = std::atoi(argv[2]);
+    size_t history_budget = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 64;
+    size_t listeners = argc > 4 ? std::max(std::atoi(argv[4]), 1) : 1;
+    std::string unix_path = argc > 5 ? argv[5] : "";
+    uint64_t user_rate = argc > 6 ? std::strtoull(argv[6], nullptr, 10) : 0;
+    uint64_t global_rate = argc > 7 ? std::strtoull(argv[7], nullptr, 10) : 0;
+    NExperiment::user_quota_ = argc > 8 ? std::strtoull(argv[8], nullptr, 10) << 10 : 0;
+    NExperiment::experiment_quota_ = argc > 9 ? std::strtoull(argv[9], nullptr, 10) << 20 : 0;
+    std::string_view policy = argc > 10 ? argv[10] : "reject";
+    if (policy != "reject" && policy != "evict") {
+        std::cerr << "quota policy must be reject or evict\n";
+        return 1;
+    }
+    NExperiment::evict_ = policy == "evict";
+
+    HttpServer server("history", history_budget << 20, user_rate, global_rate);
+
+    // The listeners split num_of_threads between their pools: the first threads % pools get one
+    // extra, and there are never more pools than threads, so the total stays at num_of_threads.
+    // The unix socket has a pool of its own, so it needs a second thread.
+    if (threads < 1u + !unix_path.empty()) {
+        std::cerr << "num_of_threads must be at least " << 1 + !unix_path.empty()
+                  << (unix_path.empty() ? "\n" : " with a unix socket\n");
+        return 1;
+    }
+    size_t pools = std::min(listeners + !unix_path.empty(), threads);
+    if (pools - !unix_path.empty() < listeners) {
+        listeners = pools - !unix_path.empty();
+        std::cerr << "listeners capped at " << listeners << " by num_of_threads\n";
+    }
+
+    std::vector<std::unique_ptr<Listener>> servers;
+    for (size_t i = 0; i < pools; ++i) {
+        auto svr = std::make_unique<Listener>();
+        size_t pool_threads = threads / pools + (i < threads % pools);
+        svr->new_task_queue = [=] {
+            return new httplib::ThreadPool(pool_threads, queue);
+        };
+        // Every watcher keeps a worker busy, so at least half of each pool stays free for requests.
+        svr->SetMaxWatchers(pool_threads / 2);
+        // Only the TCP listeners of a multi-listener start share the port, so a second
+        // instance of a single-listener server fails with EADDRINUSE instead of joining it.
+        bool shared = listeners > 1 && i < listeners;
+        svr->set_socket_options([shared](socket_t sock) {
+            int opt = 1;
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+            if (shared) {
+                setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+            }
+        });
+        svr->Route(&server);
+        servers.push_back(std::move(svr));
+    }
+
+    // Every socket is bound before any accept loop starts, so a failed bind exits cleanly.
+    for (size_t i = 0; i < listeners; ++i) {
+        if (!servers[i]->bind_to_port("0.0.0.0", 8080)) {
+            std::cerr << "cannot listen on 0.0.0.0:8080: " << std::strerror(errno) << '\n';
+            return 1;
+        }
+    }
+    if (!unix_path.empty()) {
+        ::unlink(unix_path.c_str());
+        servers.back()->set_address_family(AF_UNIX);
+        if (!servers.back()->bind_to_port(unix_path, 80)) {
+            std::cerr << "cannot listen on " << unix_path << ": " << std::strerror(errno) << '\n';
+            return 1;
+        }
+    }
+
+    std::vector<std::thread> loops;
+    for (size_t i = 1; i < pools; ++i) {
+        loops.emplace_back([&, i] {
+            if (i < listeners) {
+                PinToCore(i);
+            }
+            servers[i]->listen_after_bind();
+        });
+    }
+
+    if (listeners > 1) {
+        PinToCore(0);
+    }
+    servers[0]->listen_after_bind();
+
+    for (auto& loop : loops) {
+        loop.join();
+    }
 }
+#endif
@@ -0,0 +1,392 @@
+#define CPPHTTPLIB_USE_POLL
+
+#include "httplib.h"
+#include "json.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <random>
+#include <chrono>
+#include <algorithm>
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+using json = nlohmann::json;
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string Server;
+    int FirstPort = 0;
+    size_t Sinks = 0;
+    std::chrono::milliseconds Latency{0};
+    size_t SlowPercent = 0;
+    std::chrono::milliseconds SlowLatency{1000};
+    size_t ErrorPercent = 0;
+    size_t Secret = 0;
+    bool HasSecret = false;
+    std::string Csv;
+};
+
+// Hosts `Sinks` fake /notify endpoints on consecutive ports in one epoll loop. Every sink
+// answers after `Latency`; the first SlowPercent of every hundred sinks answer after SlowLatency,
+// and ErrorPercent of all requests get a 500, drawn from a fixed seed so runs repeat.
+class SinkFarm {
+public:
+
+    static constexpr std::chrono::seconds kIdleTimeout{10};
+    static constexpr std::chrono::seconds kFirstTimeout{60};
+
+    explicit SinkFarm(Options options)
+        : options_(std::move(options))
+        , epoll_fd_(::epoll_create1(EPOLL_CLOEXEC))
+        , random_(1)
+        , delivered_(options_.Sinks)
+    {
+        rlimit limit{};
+        ::getrlimit(RLIMIT_NOFILE, &limit);
+        limit.rlim_cur = limit.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    ~SinkFarm() {
+        for (auto& [fd, connection] : connections_) {
+            ::close(fd);
+        }
+        for (int fd : listeners_) {
+            ::close(fd);
+        }
+        ::close(epoll_fd_);
+    }
+
+    bool Listen() {
+        for (size_t i = 0; i < options_.Sinks; ++i) {
+            int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                std::cerr << "cannot create a socket for port " << options_.FirstPort + i << '\n';
+                return false;
+            }
+            int yes = 1;
+            ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port = htons(options_.FirstPort + i);
+            if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd, 1024) != 0) {
+                std::cerr << "cannot listen on port " << options_.FirstPort + i << '\n';
+                ::close(fd);
+                return false;
+            }
+
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.u64 = kListenerTag | i;
+            ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+            listeners_.push_back(fd);
+        }
+        return true;
+    }
+
+    bool Register() {
+        httplib::Client cli(options_.Server);
+        cli.set_keep_alive(true);
+        cli.set_tcp_nodelay(true);
+        for (size_t i = 0; i < options_.Sinks; ++i) {
+            json req;
+            req["host"] = "localhost:" + std::to_string(options_.FirstPort + i);
+            auto res = cli.Post("/user/register", req.dump(), "application/json");
+            if (!res || res->status != 200) {
+                std::cerr << "cannot register sink " << i << '\n';
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool Start() {
+        httplib::Client cli(options_.Server);
+        json req;
+        req["secret"] = options_.Secret;
+        start_ = Clock::now();
+        auto res = cli.Post("/admin/start", req.dump(), "application/json");
+        return res && res->status == 200;
+    }
+
+    // Serves until every sink has acknowledged at least one message, or nothing has arrived
+    // for kIdleTimeout since the last request (kFirstTimeout before the first one).
+    // Returns whether every sink was reached.
+    bool Run() {
+        std::vector<epoll_event> events(1024);
+        auto last = Clock::now();
+        while (delivered_sinks_ < options_.Sinks && Clock::now() - last < (deliveries_.empty() ? kFirstTimeout : kIdleTimeout)) {
+            int timeout = 100;
+            if (!replies_.empty()) {
+                auto wait = std::chrono::ceil<std::chrono::milliseconds>(replies_.begin()->first - Clock::now());
+                timeout = std::clamp<int64_t>(wait.count(), 0, timeout);
+            }
+
+            int ready = ::epoll_wait(epoll_fd_, events.data(), events.size(), timeout);
+            for (int i = 0; i < ready; ++i) {
+                uint64_t tag = events[i].data.u64;
+                if (tag & kListenerTag) {
+                    Accept(tag & ~kListenerTag);
+                } else {
+                    Read(static_cast<int>(tag));
+                }
+                last = Clock::now();
+            }
+
+            auto now = Clock::now();
+            for (auto it = replies_.begin(); it != replies_.end() && it->first <= now; it = replies_.erase(it)) {
+                Reply(it->second);
+            }
+        }
+        return delivered_sinks_ == options_.Sinks;
+    }
+
+    void Report() const {
+        std::vector<double> latencies;
+        size_t requests = 0;
+        size_t messages = 0;
+        size_t errors = 0;
+        Clock::time_point origin = Origin();
+        Clock::time_point last = origin;
+        for (const auto& delivery : deliveries_) {
+            ++requests;
+            if (delivery.Status != 200) {
+                ++errors;
+                continue;
+            }
+            messages += delivery.Messages;
+            latencies.push_back(Ms(delivery.Received - origin));
+            last = std::max(last, delivery.Received);
+        }
+        std::sort(latencies.begin(), latencies.end());
+
+        auto percentile = [&](double p) {
+            return latencies.empty() ? 0.0 : latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+        };
+        double span = Ms(last - origin);
+
+        std::cout << "sinks reached: " << delivered_sinks_ << '/' << options_.Sinks << '\n'
+                  << "requests: " << requests << " (injected errors: " << errors << ")\n"
+                  << "messages delivered: " << messages << '\n'
+                  << "fan-out: " << span << " ms, " << (span > 0 ? latencies.size() * 1000.0 / span : 0.0) << " deliveries/s\n"
+                  << "latency ms: p50 " << percentile(0.5) << ", p90 " << percentile(0.9)
+                  << ", p99 " << percentile(0.99) << ", max " << (latencies.empty() ? 0.0 : latencies.back()) << '\n';
+
+        if (!options_.Csv.empty()) {
+            std::ofstream out(options_.Csv);
+            out << "port,received_ms,replied_ms,status,messages\n";
+            for (const auto& delivery : deliveries_) {
+                out << options_.FirstPort + delivery.Sink << ',' << Ms(delivery.Received - origin) << ','
+                    << Ms(delivery.Replied - origin) << ',' << delivery.Status << ',' << delivery.Messages << '\n';
+            }
+        }
+    }
+
+private:
+
+    static constexpr uint64_t kListenerTag = uint64_t{1} << 63;
+
+    struct Connection {
+        size_t Sink;
+        std::string In;
+        bool Complete = false;
+    };
+
+    struct Delivery {
+        size_t Sink;
+        Clock::time_point Received;
+        Clock::time_point Replied;
+        int Status;
+        size_t Messages;
+    };
+
+    static double Ms(Clock::duration duration) {
+        return std::chrono::duration<double, std::milli>(duration).count();
+    }
+
+    // Without a start of our own, latencies count from the first request that reached any sink.
+    Clock::time_point Origin() const {
+        if (start_ != Clock::time_point{}) {
+            return start_;
+        }
+
+        Clock::time_point origin = Clock::time_point::max();
+        for (const auto& delivery : deliveries_) {
+            origin = std::min(origin, delivery.Received);
+        }
+        return origin;
+    }
+
+    void Accept(size_t sink) {
+        for (;;) {
+            int fd = ::accept4(listeners_[sink], nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                return;
+            }
+
+            connections_[fd] = {sink, {}};
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLRDHUP;
+            event.data.u64 = fd;
+            ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+        }
+    }
+
+    void Read(int fd) {
+        auto it = connections_.find(fd);
+        if (it == connections_.end() || it->second.Complete) {
+            return;
+        }
+
+        Connection& connection = it->second;
+        char buffer[4096];
+        ssize_t ret;
+        while ((ret = ::recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+            connection.In.append(buffer, ret);
+        }
+        if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            Close(fd);
+            return;
+        }
+
+        size_t end = connection.In.find("\r\n\r\n");
+        if (end == std::string::npos) {
+            return;
+        }
+        std::string head = connection.In.substr(0, end);
+        size_t length = 0;
+        bool batch = false;
+        std::istringstream lines(head);
+        for (std::string line; std::getline(lines, line);) {
+            if (strncasecmp(line.c_str(), "Content-Length:", 15) == 0) {
+                length = std::stoul(line.substr(15));
+            } else if (strncasecmp(line.c_str(), "Content-Type:", 13) == 0) {
+                batch = IsJson(line.substr(13));
+            }
+        }
+        if (connection.In.size() < end + 4 + length) {
+            return;
+        }
+
+        connection.Complete = true;
+        epoll_event event{};
+        event.data.u64 = fd;
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &event);
+
+        size_t messages = 1;
+        if (batch) {
+            json body = json::parse(connection.In.substr(end + 4, length), nullptr, false);
+            messages = body.is_array() ? body.size() : 1;
+        }
+
+        bool slow = connection.Sink % 100 < options_.SlowPercent;
+        int status = random_() % 100 < options_.ErrorPercent ? 500 : 200;
+        auto now = Clock::now();
+        deliveries_.push_back({connection.Sink, now, now, status, messages});
+        replies_.emplace(now + (slow ? options_.SlowLatency : options_.Latency), std::make_pair(fd, deliveries_.size() - 1));
+    }
+
+    // Media types are case-insensitive, and parameters such as charset follow a ';'.
+    static bool IsJson(const std::string& value) {
+        std::string media = value.substr(0, value.find(';'));
+        media.erase(0, media.find_first_not_of(" \t"));
+        media.erase(media.find_last_not_of(" \t\r") + 1);
+        return media.size() == 16 && std::equal(media.begin(), media.end(), "application/json", [](char a, char b) {
+            return std::tolower(static_cast<unsigned char>(a)) == b;
+        });
+    }
+
+    void Reply(std::pair<int, size_t> reply) {
+        auto [fd, index] = reply;
+        Delivery& delivery = deliveries_[index];
+        delivery.Replied = Clock::now();
+
+        std::string out = "HTTP/1.1 " + std::to_string(delivery.Status) + (delivery.Status == 200 ? " OK" : " Internal Server Error") +
+                          "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        [[maybe_unused]] auto _ = ::send(fd, out.data(), out.size(), MSG_NOSIGNAL);
+        Close(fd);
+
+        if (delivery.Status == 200) {
+            delivered_sinks_ += !delivered_[delivery.Sink];
+            delivered_[delivery.Sink] = true;
+        }
+    }
+
+    void Close(int fd) {
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        connections_.erase(fd);
+    }
+
+    Options options_;
+    int epoll_fd_;
+    std::mt19937 random_;
+    Clock::time_point start_;
+
+    std::vector<int> listeners_;
+    std::unordered_map<int, Connection> connections_;
+    std::multimap<Clock::time_point, std::pair<int, size_t>> replies_;
+    std::vector<Delivery> deliveries_;
+    std::vector<bool> delivered_;
+    size_t delivered_sinks_ = 0;
+};
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        std::cerr << "usage: " << argv[0] << " <server> <first_port> <sinks> [<latency_ms>] [<slow_percent>]"
+                  << " [<slow_latency_ms>] [<error_percent>] [<secret>] [<csv>]\n";
+        return 1;
+    }
+
+    Options options;
+    options.Server = argv[1];
+    options.FirstPort = std::atoi(argv[2]);
+    options.Sinks = std::atoi(argv[3]);
+    if (argc > 4) {
+        options.Latency = std::chrono::milliseconds(std::atoi(argv[4]));
+    }
+    if (argc > 5) {
+        options.SlowPercent = std::atoi(argv[5]);
+    }
+    if (argc > 6) {
+        options.SlowLatency = std::chrono::milliseconds(std::atoi(argv[6]));
+    }
+    if (argc > 7) {
+        options.ErrorPercent = std::atoi(argv[7]);
+    }
+    if (argc > 8) {
+        options.Secret = std::strtoull(argv[8], nullptr, 10);
+        options.HasSecret = true;
+    }
+    if (argc > 9) {
+        options.Csv = argv[9];
+    }
+
+    SinkFarm farm(options);
+    if (!farm.Listen() || !farm.Register()) {
+        return 1;
+    }
+    std::cout << "registered " << options.Sinks << " sinks\n";
+
+    if (options.HasSecret && !farm.Start()) {
+        std::cerr << "cannot start the experiment\n";
+        return 1;
+    }
+
+    bool complete = farm.Run();
+    farm.Report();
+    if (!complete) {
+        std::cerr << "timed out before every sink was reached\n";
+        return 1;
+    }
+    return 0;
+}